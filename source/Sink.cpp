@@ -9,7 +9,6 @@
 
 #include <MailMsgProps.h>
 
-#include "request.hpp"
 
 namespace
 {
@@ -21,7 +20,22 @@ const unsigned int min_command = 8;
 const unsigned int deny_status = 550;
 
 const unsigned int max_message = 500;
-const unsigned int max_ip = 16;
+const DWORD check_interval = 1000; // ms, between reads of configuration
+const unsigned int max_ip = 46; // INET6_ADDRSTRLEN, in case IPv4 is mapped to IPv6
+
+stats::probe p_command("command");
+stats::probe p_config("config");
+stats::probe p_client_ip("read_client_ip");
+stats::probe p_excluded("is_excluded");
+stats::probe p_rcpt("read_rcpt");
+stats::probe p_canonical("canonical");
+stats::probe p_directory("directory");
+stats::probe p_cache("cache_find");
+stats::probe p_verify("verify");
+stats::probe p_stale("cache_stale");
+stats::probe p_grace("cache_grace");
+stats::probe p_foreign_denied("foreign_denied");
+stats::probe p_foreign_accepted("foreign_accepted");
 
 std::string read_rcpt(ISmtpInCommandContext *pContext)
 {
@@ -32,34 +46,23 @@ std::string read_rcpt(ISmtpInCommandContext *pContext)
 	DWORD size = sizeof(buf);
 	com::enforce(pContext->QueryCommand(buf, &size));
 
-	if (size < min_command)
+	if (size < min_command || size > sizeof(buf))
 		throw CSink::error("Invalid SMTP protocol command");
 
-	std::string keyword(buf, buf + 4);
-	str::upper(keyword);
-	if (keyword != "RCPT")
+	if (_strnicmp(buf, "RCPT", 4) != 0)
 		throw CSink::error("SMTP protocol command different that RCPT");
 
-	std::string result(buf + min_command);
-	str::trim(result);
-	str::lower(result);
-	if (result.empty())
-		throw CSink::error("Empty recipient address");
-
-	if (result[0] == '<')
+	const char* begin = NULL;
+	const char* end = NULL;
+	switch (address::parse(buf + min_command, size - min_command, begin, end))
 	{
-		size_t close = result.find_first_of(">");
-		if (close == std::string::npos)
-			throw CSink::error("Invalid recipient address");
-		else if (close >= 2)
-			result = result.substr(1, close - 1);
-		else
-			result = "<>";
-	}
-	else if (result.find_first_of("<>") != std::string::npos)
+	case address::empty:
+		throw CSink::error("Empty recipient address");
+	case address::invalid:
 		throw CSink::error("Invalid recipient address");
+	}
 
-	return result;
+	return std::string(begin, end);
 }
 
 unsigned long read_client_ip(IMailMsgProperties *pMsg)
@@ -77,6 +80,26 @@ unsigned long read_client_ip(IMailMsgProperties *pMsg)
 	return result;
 }
 
+std::string response(unsigned int status, const char* message)
+{
+	std::string result(static_cast<std::string::size_type>(4), ' ');
+	result[0] = char((status % 1000) / 100) + '0';
+	result[1] = char((status % 100) / 10) + '0';
+	result[2] = char(status % 10) + '0';
+	result += message;
+	return result;
+}
+
+// response to recipient which does not exist
+std::string rejection(const config& c, const std::string& rcpt)
+{
+	std::string message = response(c.rcpt_status, c.rcpt_response);
+	if (c.rcpt_append)
+		message += rcpt;
+	message += "\r\n";
+	return message;
+}
+
 void deny(ISmtpInCommandContext *pContext, bool disconnect, const std::string& response, unsigned int status)
 {
 	if (pContext == NULL)
@@ -158,53 +181,208 @@ STDMETHODIMP CSink::OnSmtpInCommand(IUnknown *pServer, IUnknown *pSession, IMail
 
 	try
 	{
+		const stats::scope s_command(p_command);
+
+		sync::shared<config> pc;
+		backend::ref b;
 		{
-			const sync::scoped_lock& g_metabase = sync::acquire(metabase_);
-			if (metabase_.get() == NULL)
+			const stats::scope s_config(p_config);
 			{
-				const sync::scoped_lock& g_mbpath = sync::acquire(mbpath_);
-				if (mbpath_.get() == NULL)
-					throw CSink::error("Metabase path is not set");
-				metabase_.reset(new metabase(*mbpath_));
-			} // free mbpath_ lock
-
-			config c(*metabase_);
+				const sync::scoped_lock& g_config = sync::acquire(config_lock_);
+				pc = config_;
+				b = backend_;
+			} // free config_lock_
+
+			// metabase is checked at most once per second, by single thread;
+			// others use configuration read before
+			const LONG last = config_checked_;
+			const DWORD now = GetTickCount();
+			if (pc.get() == NULL || (now - static_cast<DWORD> (last) >= check_interval
+				&& InterlockedCompareExchange(&config_checked_, static_cast<LONG> (now), last) == last))
 			{
-				const sync::scoped_lock& g_sockets = sync::acquire(socket_);
-				if (c.refresh || socket_.get() == NULL || !socket_->is_alive(c))
+				const sync::scoped_lock& g_metabase = sync::acquire(metabase_);
+				if (metabase_.get() == NULL)
 				{
-					socket_.reset(); // Delete must be executed first
-					socket_.reset(new smtp(config(*metabase_, config::complete)));
+					const sync::scoped_lock& g_mbpath = sync::acquire(mbpath_);
+					if (mbpath_.get() == NULL)
+						throw CSink::error("Metabase path is not set");
+					metabase_.reset(new metabase(*mbpath_));
+				} // free mbpath_ lock
+
+				metabase_->load();
+				config current(*metabase_);
+				bool changed = false;
+				{
+					const sync::scoped_lock& g_config = sync::acquire(config_lock_);
+					changed = current.refresh || config_.get() == NULL
+						|| config_->server_address != current.server_address || config_->server_port != current.server_port;
+					pc = config_;
+					b = backend_;
+				} // free config_lock_
+
+				// new configuration, backend and cache are prepared while other
+				// threads keep using old ones; lock is taken only to swap them.
+				// Old backend is released without the lock, since its last user
+				// disconnects all sessions
+				if (changed)
+				{
+					sync::shared<config> complete(new config(*metabase_, config::complete));
+					backend::ref shared(*complete);
+					if (current.refresh)
+						shared->reset();
+					open_cache(*complete);
+
+					pc = complete;
+					b = shared;
+					backend::ref previous;
+					{
+						const sync::scoped_lock& g_config = sync::acquire(config_lock_);
+						config_.swap(complete);
+						previous = backend_;
+						backend_ = shared;
+					} // free config_lock_
 				}
-				else
-					socket_->reset_timer(c.request_max_delay);
-			} // free socket_ lock
-		} // free metabase_ lock
+			} // free metabase_ lock
+		}
 
-		// configuration is lock-free
-		const config& c = socket_->configuration;
+		// configuration is read-only, thus lock-free
+		const config& c = *pc;
+		stats::report(c.stats_interval, c.stats_file);
+		exclusion_.check(c.exclusion_file);
+		directory_.check(c.directory_file);
+
+		// internal server not set or invalid, accept everything
+		if (c.server_address == tcp::ip4_none)
+			return result;
 
-		unsigned long client_ip = read_client_ip(pMsg);
-		if (client_ip == tcp::ip4_none || c.is_excluded(client_ip))
+		unsigned long client_ip = tcp::ip4_none;
+		{
+			const stats::scope s_client_ip(p_client_ip);
+			client_ip = read_client_ip(pMsg);
+		}
+		if (client_ip == tcp::ip4_none)
 			return result;
+		{
+			const stats::scope s_excluded(p_excluded);
+			if (c.is_excluded(client_ip) || exclusion_.find(client_ip))
+				return result;
+		}
+
+		// blacklisted client will be disconnected, without asking internal server
+		if (harvest_.blacklisted(client_ip))
+		{
+			deny(pContext, true, response(c.temp_status, c.temp_response) + "\r\n", c.temp_status);
+			return S_FALSE;
+		}
+
+		// over the limit client will receive temporary error, without asking internal server
+		if (!limiter_.allow(client_ip, c.rate_limit, c.rate_burst))
+		{
+			deny(pContext, false, response(c.temp_status, c.temp_response) + "\r\n", c.temp_status);
+			return S_FALSE;
+		}
 
-		std::string rcpt = read_rcpt(pContext);
-		request r(c, *socket_);
+		// recipient is verified in canonical form, but client will see it as it was sent
+		std::string rcpt, canonical;
+		{
+			const stats::scope s_rcpt(p_rcpt);
+			rcpt = read_rcpt(pContext);
+		}
+		{
+			const stats::scope s_canonical(p_canonical);
+			canonical = c.canonical(rcpt);
+		}
+		if (canonical != rcpt)
+		{
+			char message[max_message] = {0};
+			if (str::format(std::nothrow, message, "RCPT %.200s verified as %.200s\n", rcpt.c_str(), canonical.c_str()))
+				OutputDebugStringA(message);
+		}
 
-		if (r(rcpt))
+		// relay to domain not hosted by internal server is answered without asking it
+		if (!c.is_hosted(canonical))
 		{
-			if (r.denied())
+			if (!c.foreign_deny)
 			{
-				std::string response(static_cast<std::string::size_type>(4), ' ');
-				response[0] = char((c.rcpt_status % 1000) / 100) + '0';
-				response[1] = char((c.rcpt_status % 100) / 10) + '0';
-				response[2] = char(c.rcpt_status % 10) + '0';
-				response += c.rcpt_response;
-				if (c.rcpt_append)
-					response += rcpt;
-				response += "\r\n";
-
-				deny(pContext, c.force_disconnect, response, c.rcpt_status);
+				stats::count(p_foreign_accepted);
+				return result;
+			}
+
+			stats::count(p_foreign_denied);
+			deny(pContext, c.force_disconnect, rejection(c, rcpt), c.rcpt_status);
+			return S_FALSE;
+		}
+
+		// exported directory of mailboxes is asked first, then cache and internal server
+		bool allow = true;
+		bool found = false;
+		{
+			const stats::scope s_directory(p_directory);
+			found = directory_.verify(c, canonical, allow);
+		}
+
+		const unsigned __int64 key = cache::key(c.server_address, c.server_port, canonical);
+		const unsigned long retention = c.cache_ttl + c.cache_stale + c.cache_grace;
+		bool cached = false;
+		unsigned long left = 0;
+		sync::shared<cache> ch;
+		{
+			const sync::scoped_lock& g_cache = sync::acquire(cache_lock_);
+			ch = cache_;
+		} // free cache_lock_
+
+		// lookup is lock-free, and insert locks only one shard of the cache
+		if (!found && ch.get() != NULL)
+		{
+			const stats::scope s_cache(p_cache);
+			cached = found = ch->find(key, allow, left);
+		}
+
+		// verdict past its time to live is served while it is refreshed in
+		// background, and past stale time only if internal server cannot be asked
+		const unsigned long age = (cached && left < retention) ? retention - left : 0;
+		if (cached && age >= c.cache_ttl)
+		{
+			if (age < c.cache_ttl + c.cache_stale)
+			{
+				stats::count(p_stale);
+				refresher_.schedule(pc, b, ch, canonical, key);
+			}
+			else
+				found = false;
+		}
+
+		if (!found)
+		{
+			bool verified = false;
+			bool fresh = true;
+			{
+				const stats::scope s_verify(p_verify);
+				verified = b->verify(c, canonical, fresh);
+			}
+
+			if (verified)
+			{
+				found = true;
+				allow = fresh;
+				if (ch.get() != NULL)
+					ch->insert(key, allow, retention);
+			}
+			else if (cached)
+			{
+				// internal server is not available, cached verdict is better than none
+				found = true;
+				stats::count(p_grace);
+			}
+		}
+
+		if (found)
+		{
+			if (!allow)
+			{
+				// client guessing recipient addresses will be disconnected, even if force_disconnect is not set
+				bool disconnect = harvest_.denied(client_ip, pSession, pMsg, c.harvest_session, c.harvest_client, c.harvest_window, c.harvest_blacklist);
+				deny(pContext, c.force_disconnect || disconnect, rejection(c, rcpt), c.rcpt_status);
 				result = S_FALSE;
 			}
 		}
@@ -217,3 +395,38 @@ STDMETHODIMP CSink::OnSmtpInCommand(IUnknown *pServer, IUnknown *pSession, IMail
 	return result;
 }
 
+void CSink::open_cache(const config& c)
+{
+	sync::shared<cache> current;
+	{
+		const sync::scoped_lock& g = sync::acquire(cache_lock_);
+		current = cache_;
+	} // free cache_lock_
+
+	if (c.cache_ttl != 0 && current.get() != NULL && current->matches(c.cache_file, c.cache_size))
+		return;
+
+	// old cache is unmapped when last request using it is done
+	current.reset();
+	{
+		const sync::scoped_lock& g = sync::acquire(cache_lock_);
+		cache_.swap(current);
+	} // free cache_lock_
+
+	if (c.cache_ttl == 0)
+		return;
+
+	try
+	{
+		sync::shared<cache> created(new cache(c.cache_file, c.cache_size));
+		const sync::scoped_lock& g = sync::acquire(cache_lock_);
+		cache_.swap(created);
+	}
+	catch (const cache::error& e)
+	{
+		// sink can do without cache, no need to fail verification
+		char message[max_message] = {0};
+		if (str::format(std::nothrow, message, "Exception in %s, cache::error : %s\n", __FUNCTION__, e.what()))
+			OutputDebugStringA(message);
+	}
+}
@@ -13,7 +13,15 @@
 #include "util_win32.hpp"
 #include "util_ptr.hpp"
 #include "metabase.hpp"
-#include "smtp.hpp"
+#include "backend.hpp"
+#include "limiter.hpp"
+#include "harvest.hpp"
+#include "cache.hpp"
+#include "address.hpp"
+#include "stats.hpp"
+#include "exclusion.hpp"
+#include "directory.hpp"
+#include "refresher.hpp"
 
 // CSink
 
@@ -28,7 +36,17 @@ class ATL_NO_VTABLE CSink :
 {
 	sync::ptr<metabase, win32::critical_section>			metabase_;
 	sync::ptr<metabase::path, win32::critical_section>		mbpath_;
-	sync::ptr<smtp, win32::critical_section>				socket_;
+	win32::critical_section									config_lock_;
+	sync::shared<config>									config_;	// guarded by config_lock_
+	backend::ref											backend_;	// guarded by config_lock_
+	volatile LONG											config_checked_;	// GetTickCount() of last read
+	win32::critical_section									cache_lock_;
+	sync::shared<cache>										cache_;		// guarded by cache_lock_
+	limiter													limiter_;
+	harvest													harvest_;
+	exclusion												exclusion_;
+	directory												directory_;
+	refresher												refresher_;
 
 	// non-copyable and non-assignable
 	CSink(const& CSink);
@@ -40,7 +58,7 @@ public:
 		explicit error(const char* msg) : std::runtime_error(msg) {}
 	};
 
-	CSink()
+	CSink() : config_checked_(0)
 	{
 	}
 
@@ -67,6 +85,9 @@ public:
 
 	void FinalRelease() 
 	{
+		// background refresh uses cache and backend
+		refresher_.stop();
+
 		{
 			const sync::scoped_lock& g = sync::acquire(metabase_);
 			metabase_.reset();
@@ -77,15 +98,28 @@ public:
 			mbpath_.reset();
 		} // free mbpath_ lock
 
-		const sync::scoped_lock& g = sync::acquire(socket_);
-		socket_.reset();
+		{
+			const sync::scoped_lock& g = sync::acquire(cache_lock_);
+			cache_.reset();
+		} // free cache_lock_
+
+		// backend will be disconnected if this was the last sink using it
+		const sync::scoped_lock& g = sync::acquire(config_lock_);
+		backend_ = backend::ref();
+		config_.reset();
 	}
 
+	void open_cache(const config& c);
+
 	void init();
 
 public:
 	STDMETHOD(Register)(VARIANT instance, BSTR binding_guid, VARIANT_BOOL enabled, VARIANT priority, BSTR server_address);
 	STDMETHOD(Unregister)(VARIANT instance, BSTR binding_guid);
+	STDMETHOD(BuildDirectory)(BSTR source, BSTR target, VARIANT_BOOL fold_local, long* count);
+	STDMETHOD(VerifyList)(VARIANT instance, BSTR binding_guid, BSTR source, BSTR target, long rate, BSTR* summary);
+	STDMETHOD(ServePolicy)(VARIANT instance, BSTR binding_guid, BSTR address, long port);
+	STDMETHOD(ServeSocketmap)(VARIANT instance, BSTR binding_guid, BSTR address, long port);
 
 	// IEventIsCacheable Methods
 public:
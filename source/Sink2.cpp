@@ -9,6 +9,11 @@
 
 #include "util.hpp"
 #include "metabase.hpp"
+#include "bulk.hpp"
+#include "listener.hpp"
+#include "postfix.hpp"
+#include "service.hpp"
+#include "socketmap.hpp"
 
 namespace
 {
@@ -73,6 +78,42 @@ HRESULT exception_handler(const char* function)
 	}
 }
 
+// front-end serving Protocol on given address, until listening socket fails
+template <typename Protocol>
+void serve(VARIANT instance, BSTR binding_guid, BSTR address, long port)
+{
+	com::enforce(static_cast<void *> (binding_guid));
+	com::enforce(static_cast<void *> (address));
+
+	const unsigned long ip = tcp::ip4_addr(static_cast<const wchar_t*> (address));
+	if (ip == tcp::ip4_none || port <= 0 || port > 0xFFFF)
+		AtlThrow(E_INVALIDARG);
+
+	CComVariant vinstance(instance);
+	com::enforce(vinstance.ChangeType(VT_UI4));
+
+	// configuration of sink registered with given binding, see Register
+	metabase mb(metabase::path(static_cast<const wchar_t*> (binding_guid), vinstance.ulVal));
+	mb.load();
+	const config c(mb, config::complete);
+	const tcp::startup winsock;
+	service s(c);
+	Protocol p(s);
+
+	// each thread verifies one request at a time
+	const unsigned int threads = std::max(c.connections, 1U) * std::max(c.pipeline_depth, 1U) * 2;
+	try
+	{
+		listener l(p, tcp::ip4_host(ip, static_cast<unsigned short> (port)), threads);
+		l.run();
+	}
+	catch (const tcp::error& e)
+	{
+		AtlReportError(CLSID_Sink, e.what(), IID_ISink, E_FAIL);
+		AtlThrow(E_FAIL);
+	}
+}
+
 } // unnamed namespace
 
 STDMETHODIMP CSink::Load(IPropertyBag * pPropBag, IErrorLog * pErrorLog)
@@ -252,6 +293,120 @@ STDMETHODIMP CSink::Unregister(VARIANT instance, BSTR binding_guid)
 	return result;
 }
 
+STDMETHODIMP CSink::BuildDirectory(BSTR source, BSTR target, VARIANT_BOOL fold_local, long* count)
+{
+	HRESULT result = S_OK;
+
+	try
+	{
+		com::enforce(static_cast<void *> (source));
+		com::enforce(static_cast<void *> (target));
+		com::enforce(static_cast<void *> (count));
+
+		std::string src, dst;
+		if (!str::cast(src, source, SysStringLen(source)) || !str::cast(dst, target, SysStringLen(target)))
+			AtlThrow(E_INVALIDARG);
+
+		try
+		{
+			*count = static_cast<long> (directory::build(src.c_str(), dst.c_str(), fold_local != VARIANT_FALSE));
+		}
+		catch (const directory::error& e)
+		{
+			AtlReportError(CLSID_Sink, e.what(), IID_ISink, E_FAIL);
+			AtlThrow(E_FAIL);
+		}
+	}
+	catch(...)
+	{
+		result = exception_handler(__FUNCTION__);
+	}
+
+	return result;
+}
+
+STDMETHODIMP CSink::VerifyList(VARIANT instance, BSTR binding_guid, BSTR source, BSTR target, long rate, BSTR* summary)
+{
+	HRESULT result = S_OK;
+
+	try
+	{
+		com::enforce(static_cast<void *> (binding_guid));
+		com::enforce(static_cast<void *> (source));
+		com::enforce(static_cast<void *> (target));
+		com::enforce(static_cast<void *> (summary));
+
+		std::string src, dst;
+		if (rate < 0 || !str::cast(src, source, SysStringLen(source)) || !str::cast(dst, target, SysStringLen(target)))
+			AtlThrow(E_INVALIDARG);
+
+		CComVariant vinstance(instance);
+		com::enforce(vinstance.ChangeType(VT_UI4));
+
+		// configuration of sink registered with given binding, see Register
+		metabase mb(metabase::path(static_cast<const wchar_t*> (binding_guid), vinstance.ulVal));
+		mb.load();
+		const config c(mb, config::complete);
+		const tcp::startup winsock;
+		const backend::ref b(c);
+
+		try
+		{
+			const bulk::summary s = bulk::verify(c, b, src.c_str(), dst.c_str(), static_cast<unsigned int> (rate));
+			const unsigned long verified = s.accepted + s.rejected + s.unverified + s.invalid;
+
+			std::wstring text;
+			str::format(text, L"%lu accepted, %lu rejected, %lu unverified, %lu invalid, %lu skipped as verified before; "
+				L"%lu ms, %lu per second, %lu batches, slowest %lu ms",
+				s.accepted, s.rejected, s.unverified, s.invalid, s.skipped, s.elapsed,
+				static_cast<unsigned long> ((1000ULL * verified) / std::max(s.elapsed, 1UL)), s.batches, s.slowest);
+			*summary = CComBSTR(text.c_str()).Detach();
+		}
+		catch (const bulk::error& e)
+		{
+			AtlReportError(CLSID_Sink, e.what(), IID_ISink, E_FAIL);
+			AtlThrow(E_FAIL);
+		}
+	}
+	catch(...)
+	{
+		result = exception_handler(__FUNCTION__);
+	}
+
+	return result;
+}
+
+STDMETHODIMP CSink::ServePolicy(VARIANT instance, BSTR binding_guid, BSTR address, long port)
+{
+	HRESULT result = S_OK;
+
+	try
+	{
+		serve<postfix>(instance, binding_guid, address, port);
+	}
+	catch(...)
+	{
+		result = exception_handler(__FUNCTION__);
+	}
+
+	return result;
+}
+
+STDMETHODIMP CSink::ServeSocketmap(VARIANT instance, BSTR binding_guid, BSTR address, long port)
+{
+	HRESULT result = S_OK;
+
+	try
+	{
+		serve<socketmap>(instance, binding_guid, address, port);
+	}
+	catch(...)
+	{
+		result = exception_handler(__FUNCTION__);
+	}
+
+	return result;
+}
 
 void CSink::init()
 {
@@ -264,6 +419,7 @@ void CSink::init()
 		metabase_.reset(new metabase(*mbpath_));
 	} // free mbpath_ lock
 
+	metabase_->load();
 	config c(*metabase_);
 
 	std::wstring exclusions = L"127.0.0.1";
@@ -280,10 +436,9 @@ void CSink::init()
 	unsigned char buf[sexcl_buffer * sizeof(wchar_t)];
 	exclusions.copy(reinterpret_cast<wchar_t*> (buf), sexcl_buffer);
 
-	METADATA_RECORD record = {sexcl, 0, 0, MULTISZ_METADATA, static_cast<DWORD> (exclusions.size() * sizeof(wchar_t)), buf, 0};
-	metabase_->write(record);
-
 	unsigned char buf2[sizeof(DWORD)] = {0};
-	METADATA_RECORD record2 = {srefr, 0, 0, DWORD_METADATA, sizeof(buf2), buf2, 0};
-	metabase_->write(record2);
+	METADATA_RECORD records[2] = {
+		{sexcl, 0, 0, MULTISZ_METADATA, static_cast<DWORD> (exclusions.size() * sizeof(wchar_t)), buf, 0},
+		{srefr, 0, 0, DWORD_METADATA, sizeof(buf2), buf2, 0}};
+	metabase_->write(records, 2);
 }
@@ -0,0 +1,243 @@
+// address.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "address.hpp"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define ADDRESS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+namespace
+{
+
+// blank is any character trimmed by str::trim, i.e. space or control
+inline bool blank(char ch)
+{
+	return static_cast<unsigned char> (ch) <= ' ';
+}
+
+// special is control character or angle bracket
+inline bool special(char ch)
+{
+	const unsigned char c = static_cast<unsigned char> (ch);
+	return c < ' ' || c == 0x7F || c == '<' || c == '>';
+}
+
+const char* find_special(const char* begin, const char* end)
+{
+	while (begin != end && !special(*begin))
+		++begin;
+	return begin;
+}
+
+void lower_scalar(char* data, size_t len)
+{
+	for (char* const end = data + len; data != end; ++data)
+	{
+		if (*data >= 'A' && *data <= 'Z')
+			*data += 'a' - 'A';
+	}
+}
+
+#ifdef ADDRESS_SSE2
+
+const char* find_special_sse2(const char* begin, const char* end)
+{
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i del = _mm_set1_epi8(0x7F);
+	const __m128i ctl = _mm_set1_epi8(' ' - 1);
+
+	for (; end - begin >= 16; begin += 16)
+	{
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*> (begin));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, lt), _mm_cmpeq_epi8(x, gt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, del));
+		// unsigned x < ' ' is the same as min(x, ' ' - 1) == x
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x));
+
+		const int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+		{
+			int i = 0;
+			while ((mask & (1 << i)) == 0)
+				++i;
+			return begin + i;
+		}
+	}
+
+	return find_special(begin, end);
+}
+
+void lower_sse2(char* data, size_t len)
+{
+	// 'A' .. 'Z' shifted to -128 .. -103, all other characters above that
+	const __m128i shift = _mm_set1_epi8(static_cast<char> (0x80 - 'A'));
+	const __m128i limit = _mm_set1_epi8(static_cast<char> (0x80 + 26));
+	const __m128i fold = _mm_set1_epi8('a' - 'A');
+
+	for (; len >= 16; data += 16, len -= 16)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*> (data));
+		const __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(x, shift), limit);
+		x = _mm_add_epi8(x, _mm_and_si128(upper, fold));
+		_mm_storeu_si128(reinterpret_cast<__m128i*> (data), x);
+	}
+
+	lower_scalar(data, len);
+}
+
+#ifdef _DEBUG
+
+// compare results of SSE2 and scalar functions for data of given length
+bool equivalent(const char* data, size_t len)
+{
+	if (find_special_sse2(data, data + len) != find_special(data, data + len))
+		return false;
+
+	char scalar[48];
+	char vector[48];
+	memcpy(scalar, data, len);
+	memcpy(vector, data, len);
+	lower_scalar(scalar, len);
+	lower_sse2(vector, len);
+	return memcmp(scalar, vector, len) == 0;
+}
+
+// self-check of debug builds, run once before SSE2 functions are used:
+// every character at every position of three blocks, then pseudo-random
+// data of random length. Any difference means scalar functions are used
+bool self_check()
+{
+	char data[48];
+	for (unsigned int c = 0; c < 256; ++c)
+	{
+		for (size_t i = 0; i < sizeof(data); ++i)
+		{
+			memset(data, 'X', sizeof(data));
+			data[i] = static_cast<char> (c);
+			if (!equivalent(data, i + 1) || !equivalent(data, sizeof(data)))
+				return false;
+		}
+	}
+
+	unsigned long seed = 0x2545F491UL;
+	for (unsigned int round = 0; round < 4096; ++round)
+	{
+		// most characters plain letters, so that specials are found past first block
+		for (size_t i = 0; i < sizeof(data); ++i)
+		{
+			seed = seed * 1664525UL + 1013904223UL;
+			const unsigned int r = static_cast<unsigned int> (seed >> 16);
+			data[i] = static_cast<char> ((r & 0x1F) == 0 ? r >> 8 : 'A' + (r >> 8) % 58);
+		}
+
+		seed = seed * 1664525UL + 1013904223UL;
+		if (!equivalent(data, (seed >> 16) % (sizeof(data) + 1)))
+			return false;
+	}
+
+	return true;
+}
+
+#endif // _DEBUG
+
+bool use_sse2()
+{
+	if (IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) == FALSE)
+		return false;
+
+#ifdef _DEBUG
+	if (!self_check())
+	{
+		OutputDebugStringA("SSE2 parsing of addresses differs from scalar one, SSE2 is not used\n");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+const bool sse2 = use_sse2();
+
+#endif // ADDRESS_SSE2
+
+inline const char* scan(const char* begin, const char* end)
+{
+#ifdef ADDRESS_SSE2
+	if (sse2)
+		return find_special_sse2(begin, end);
+#endif
+	return find_special(begin, end);
+}
+
+} // unnamed namespace
+
+namespace address
+{
+
+status parse(const char* data, size_t len, const char*& begin, const char*& end)
+{
+	const char* first = data;
+	const char* last = static_cast<const char*> (memchr(data, '\0', len));
+	if (last == NULL)
+		last = data + len;
+
+	while (first != last && blank(*first))
+		++first;
+	while (last != first && blank(*(last - 1)))
+		--last;
+	if (first == last)
+		return empty;
+
+	if (*first != '<')
+	{
+		if (scan(first, last) != last)
+			return invalid;
+
+		begin = first;
+		end = last;
+		return valid;
+	}
+
+	const char* close = scan(first + 1, last);
+	if (close == last || *close != '>')
+		return invalid;
+
+	if (close == first + 1)
+	{
+		begin = first;
+		end = close + 1;
+	}
+	else
+	{
+		begin = first + 1;
+		end = close;
+	}
+
+	return valid;
+}
+
+void lower(char* data, size_t len)
+{
+#ifdef ADDRESS_SSE2
+	if (sse2)
+	{
+		lower_sse2(data, len);
+		return;
+	}
+#endif
+	lower_scalar(data, len);
+}
+
+} // namespace address
@@ -0,0 +1,39 @@
+// address.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+// Parsing of recipient address sent in RCPT command. Address is found in
+// single pass over command buffer, without copying: blanks are trimmed,
+// angle brackets removed and control characters rejected. If processor
+// supports SSE2 instructions, characters are scanned in blocks of 16;
+// debug builds check this against scalar code once, when module is loaded.
+namespace address
+{
+
+enum status
+{
+	valid,
+	empty,
+	invalid
+};
+
+// parse argument of RCPT command, i.e. text following "RCPT TO:", up to
+// len characters or terminating zero. On success address points into
+// data; null address is returned as "<>". Trailing parameters of RCPT
+// command are ignored
+status parse(const char* data, size_t len, const char*& begin, const char*& end);
+
+// fold ASCII letters to lower case, other characters are left intact
+void lower(char* data, size_t len);
+
+inline void lower(std::string& str)
+{
+	if (!str.empty())
+		lower(&str[0], str.size());
+}
+
+} // namespace address
@@ -0,0 +1,783 @@
+// backend.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "backend.hpp"
+#include "request.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+stats::probe p_connect("connect");
+stats::probe p_request("request");
+stats::probe p_request_vrfy("request_vrfy");
+stats::probe p_request_pipelined("request_pipelined");
+stats::probe p_wait("connection_wait");
+stats::probe p_learned("learned");
+stats::probe p_learn_probe("learn_probe");
+
+const unsigned int max_message = 500;
+
+// RFC 2821, 4.5.3.1 requires server to accept at least 100 recipients
+const size_t max_pipeline = 100;
+
+// busy sessions are checked at least this often (in ms), even if their
+// release was not signaled, e.g. after exception
+const unsigned long max_poll = 50;
+
+// time (in ms) after its deadline, when thread verifying waiters of other
+// threads is expected to signal them
+const unsigned long max_linger = 1000;
+
+// local part of address which should not exist in any domain
+std::string nonexistent()
+{
+	static volatile LONG counter = 0;
+	const unsigned __int64 seed = (static_cast<unsigned __int64> (GetTickCount()) << 32) ^ InterlockedIncrement(&counter);
+
+	std::string result;
+	str::format(result, "rcptproxy-probe-%016I64x", str::hash(reinterpret_cast<const char*> (&seed), sizeof(seed)));
+	return result;
+}
+
+// reply which surely tells whether mailbox exists (RFC 2821, 4.2.2). Temporary
+// failure, e.g. outage or greylisting, or policy rejection (e.g. 554) does not
+bool conclusive(unsigned int code)
+{
+	return (code >= 200 && code < 300) || code == 550 || code == 551 || code == 553;
+}
+
+const char* describe(catchall::verdict v)
+{
+	switch (v)
+	{
+	case catchall::accept_all:
+		return "accepting all recipients";
+	case catchall::reject_all:
+		return "rejecting all recipients";
+	}
+	return "normal";
+}
+
+typedef std::map<backend::key, backend*> registry_t;
+
+// process-wide registry of backends
+win32::critical_section		registry_lock;
+registry_t					registry;
+
+} // unnamed namespace
+
+backend::key::key(const config& c) :
+	server_address(c.server_address),
+	server_port(c.server_port),
+	protocol_helo(c.protocol_helo),
+	protocol_from(c.protocol_from),
+	conn_idle_timeout(c.conn_idle_timeout),
+	conn_max_time(c.conn_max_time),
+	connections(c.connections),
+	pipeline_depth(c.pipeline_depth)
+{}
+
+bool operator< (const backend::key& lh, const backend::key& rh)
+{
+	if (lh.server_address != rh.server_address)
+		return lh.server_address < rh.server_address;
+	if (lh.server_port != rh.server_port)
+		return lh.server_port < rh.server_port;
+	if (lh.conn_idle_timeout != rh.conn_idle_timeout)
+		return lh.conn_idle_timeout < rh.conn_idle_timeout;
+	if (lh.conn_max_time != rh.conn_max_time)
+		return lh.conn_max_time < rh.conn_max_time;
+	if (lh.connections != rh.connections)
+		return lh.connections < rh.connections;
+	if (lh.pipeline_depth != rh.pipeline_depth)
+		return lh.pipeline_depth < rh.pipeline_depth;
+	if (lh.protocol_helo != rh.protocol_helo)
+		return lh.protocol_helo < rh.protocol_helo;
+	return lh.protocol_from < rh.protocol_from;
+}
+
+backend::ref::ref(const config& c) : ptr_(backend::attach(c))
+{}
+
+backend::ref::ref(const ref& rh) : ptr_(rh.ptr_)
+{
+	// rh holds reference, thus counter cannot drop to zero here
+	if (ptr_ != NULL)
+		InterlockedIncrement(&ptr_->refs_);
+}
+
+backend::ref::~ref()
+{
+	if (ptr_ != NULL)
+		backend::detach(ptr_);
+}
+
+backend::ref& backend::ref::operator=(const ref& rh)
+{
+	ref t(rh);
+	std::swap(ptr_, t.ptr_);
+	return *this;
+}
+
+backend::backend(const config& c) :
+	key_(c),
+	config_(c),
+	refs_(1),
+	next_(0),
+	vrfy_(1),
+	queue_(NULL),
+	sessions_(std::max(c.connections, 1U))
+{
+	released_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (*released_ == NULL)
+		throw sync::error("CreateEvent failed");
+}
+
+backend::~backend()
+{
+	reset();
+
+	for (size_t i = 0; i < spare_.size(); ++i)
+	{
+		CloseHandle(spare_[i]->done);
+		delete spare_[i];
+	}
+}
+
+backend* backend::attach(const config& c)
+{
+	const key k(c);
+
+	const sync::scoped_lock& g = sync::acquire(registry_lock);
+	registry_t::iterator i = registry.find(k);
+	if (i != registry.end())
+	{
+		if (InterlockedIncrement(&i->second->refs_) > 1)
+			return i->second;
+
+		// counter was zero, that is last user is waiting for registry_lock to delete this
+		// backend. Leave it alone and replace with new one
+		InterlockedDecrement(&i->second->refs_);
+		registry.erase(i);
+	}
+
+	backend* b = new backend(c);
+	try
+	{
+		registry.insert(std::make_pair(k, b));
+	}
+	catch (...)
+	{
+		delete b;
+		throw;
+	}
+
+	return b;
+}
+
+void backend::detach(backend* b)
+{
+	if (InterlockedDecrement(&b->refs_) != 0)
+		return;
+
+	{
+		const sync::scoped_lock& g = sync::acquire(registry_lock);
+		registry_t::iterator i = registry.find(b->key_);
+		if (i != registry.end() && i->second == b)
+			registry.erase(i);
+	} // free registry_lock
+
+	// disconnecting might take a while, do not block registry for that time
+	delete b;
+}
+
+bool backend::query(smtp& s, const config& c, const std::string& rcpt, bool& allow, const deadline& d)
+{
+	// caller must own lock of s
+	request r(c, s, d);
+	request::status result = request::undecided;
+	if (c.verify_vrfy && vrfy_ != 0)
+	{
+		const stats::scope s_vrfy(p_request_vrfy);
+		result = r.vrfy(rcpt);
+	}
+
+	if (result == request::failed)
+		return false;
+	else if (result == request::unsupported && InterlockedExchange(&vrfy_, 0) != 0)
+		OutputDebugStringA("VRFY not supported by internal server, using MAIL and RCPT\n");
+
+	if (result != request::answered)
+	{
+		const stats::scope s_request(p_request);
+		if (!r(rcpt))
+			return false;
+	}
+
+	allow = r.allowed();
+
+	const size_t at = rcpt.rfind('@');
+	if (c.learn_threshold != 0 && at != std::string::npos)
+		learn(s, c, rcpt.c_str() + at + 1, r.code(), d);
+	return true;
+}
+
+bool backend::learned(const config& c, const char* domain, bool& allow)
+{
+	switch (c.learned_policy(domain))
+	{
+	case config::policy_accept:
+		allow = true;
+		return true;
+	case config::policy_reject:
+		allow = false;
+		return true;
+	case config::policy_verify:
+		return false;
+	}
+
+	if (c.learn_threshold == 0)
+		return false;
+
+	switch (learned_.find(domain))
+	{
+	case catchall::accept_all:
+		allow = true;
+		break;
+	case catchall::reject_all:
+		allow = false;
+		break;
+	default:
+		return false;
+	}
+
+	stats::count(p_learned);
+	return true;
+}
+
+void backend::learn(smtp& s, const config& c, const char* domain, unsigned int code, const deadline& d)
+{
+	// caller must own lock of s. Other replies neither make nor break streak
+	if (!conclusive(code))
+		return;
+
+	const bool allow = (code < 300);
+	if (c.learned_policy(domain) != config::policy_learn || !learned_.observe(domain, allow, c.learn_threshold))
+		return;
+
+	// confirm with recipient whose verdict is known: nonexistent one must
+	// be rejected, and postmaster must be accepted (RFC 2821, 4.5.1)
+	catchall::verdict v = allow ? catchall::accept_all : catchall::reject_all;
+	if (c.learn_probe)
+	{
+		const std::string probe = (allow ? nonexistent() : std::string("postmaster")) + '@' + domain;
+		const stats::scope s_probe(p_learn_probe);
+		request p(c, s, d);
+		if (!s.is_alive(c, d) || !p(probe) || !conclusive(p.code()))
+			return; // try again with next verdict
+
+		if (p.allowed() != allow)
+			v = catchall::normal;
+	}
+
+	learned_.classify(domain, v, c.learn_ttl);
+
+	char message[max_message] = {0};
+	if (str::format(std::nothrow, message, "Domain %.200s learned as %s for %u seconds\n", domain, describe(v), c.learn_ttl))
+		OutputDebugStringA(message);
+}
+
+void backend::query(smtp& s, const config& c, waiter* const* batch, size_t count, const deadline& d)
+{
+	// caller must own lock of s. VRFY cannot be pipelined (RFC 2920, 3.1)
+	if (count > 1 && s.pipelining() && !(c.verify_vrfy && vrfy_ != 0))
+	{
+		std::vector<const std::string*> rcpts(count);
+		for (size_t i = 0; i < count; ++i)
+			rcpts[i] = batch[i]->rcpt;
+
+		request r(c, s, d);
+		{
+			const stats::scope s_request(p_request_pipelined);
+			if (!r(rcpts))
+				return;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			batch[i]->verified = r.verified(i);
+			batch[i]->allow = r.allowed(i);
+		}
+
+		for (size_t i = 0; c.learn_threshold != 0 && i < count; ++i)
+		{
+			const size_t at = batch[i]->rcpt->rfind('@');
+			if (batch[i]->verified && at != std::string::npos)
+				learn(s, c, batch[i]->rcpt->c_str() + at + 1, r.code(i), d);
+		}
+		return;
+	}
+
+	// one by one, connection is reset before each but first
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (i != 0 && !s.is_alive(c, d))
+			return;
+		batch[i]->verified = query(s, c, *batch[i]->rcpt, batch[i]->allow, d);
+	}
+}
+
+void backend::verify(session& s, const config& c, waiter* const* batch, size_t count, const deadline& d)
+{
+	// caller must own lock of s. Time spent waiting for it counts too
+	if (d.expired())
+		return;
+
+	// lock of connection is taken once, for liveness check and request
+	if (s.get() != NULL)
+	{
+		const sync::scoped_lock& g = sync::acquire(*s);
+		if (s->is_alive(c, d))
+		{
+			query(*s, c, batch, count, d);
+			return;
+		}
+	} // free lock of connection, it is going to be deleted
+
+	s.reset(); // Delete must be executed first
+	s.reset(new smtp(config_));
+
+	const sync::scoped_lock& g = sync::acquire(*s);
+	tcp::status result = tcp::success;
+	{
+		const stats::scope s_connect(p_connect);
+		result = s->open(d);
+	}
+	if (result == tcp::success)
+	{
+		query(*s, c, batch, count, d);
+		return;
+	}
+
+	g.unlock();
+	s.reset();
+}
+
+void backend::verify_share(const config& c, size_t first, waiter* const* batch, size_t count, const deadline& d)
+{
+	// any connection not in use will do, busy ones are waited for until deadline
+	for (;;)
+	{
+		session* s = NULL;
+		const sync::scoped_lock& g = take(first, s);
+		if (g.active())
+		{
+			// groups are no larger than pipeline depth
+			const size_t depth = std::max<size_t> (1, std::min<size_t> (c.pipeline_depth, max_pipeline));
+			for (size_t i = 0; i < count && !d.expired(); i += depth)
+				verify(*s, c, batch + i, std::min(depth, count - i), d);
+
+			g.unlock();
+			SetEvent(*released_);
+			return;
+		}
+		else if (d.expired())
+			return;
+
+		WaitForSingleObject(*released_, std::min(d.ms(), max_poll));
+	}
+}
+
+DWORD WINAPI backend::share_thread(void* pv)
+{
+	share* const p = static_cast<share*> (pv);
+	try
+	{
+		p->owner->verify_share(*p->configuration, p->first, p->batch, p->count, *p->limit);
+	}
+	catch (const std::exception& e)
+	{
+		// recipients not verified are left as such
+		char message[max_message];
+		if (str::format(std::nothrow, message, "Exception in %s, %s : %s\n", __FUNCTION__, typeid(e).name(), e.what()))
+			OutputDebugStringA(message);
+	}
+	return 0;
+}
+
+sync::lock<win32::critical_section> backend::take(size_t first, session*& s)
+{
+	// first session not in use by other thread. Lock is not active if all are busy
+	const size_t n = sessions_.size;
+	for (size_t i = 0; ; ++i)
+	{
+		s = &sessions_[(first + i) % n];
+		sync::lock<win32::critical_section> g = sync::try_acquire(*s);
+		if (g.active() || i + 1 == n)
+			return g;
+	}
+}
+
+void backend::push(waiter* w)
+{
+	// waiters are never popped one by one, only all at once, thus no ABA problem
+	void* head = NULL;
+	do
+	{
+		head = queue_;
+		w->next = static_cast<waiter*> (head);
+	} while (InterlockedCompareExchangePointer(reinterpret_cast<void* volatile*> (&queue_), w, head) != head);
+}
+
+backend::waiter* backend::pop_all()
+{
+	// take all waiters and put oldest first
+	waiter* w = static_cast<waiter*> (InterlockedExchangePointer(reinterpret_cast<void* volatile*> (&queue_), NULL));
+	waiter* head = NULL;
+	while (w != NULL)
+	{
+		waiter* const next = w->next;
+		w->next = head;
+		head = w;
+		w = next;
+	}
+
+	return head;
+}
+
+bool backend::withdraw(waiter* self)
+{
+	// put back all waiters but self, oldest first. False if self was taken by other thread
+	bool result = false;
+	for (waiter* w = pop_all(); w != NULL; )
+	{
+		waiter* const next = w->next;
+		if (w == self)
+			result = true;
+		else
+			push(w);
+		w = next;
+	}
+
+	return result;
+}
+
+bool backend::leave(waiter* self)
+{
+	// when true is returned, no other thread will touch self
+	for (;;)
+	{
+		if (withdraw(self))
+			return true;
+
+		// taken by thread which will signal soon after its own deadline
+		if (self->claimed != 0)
+		{
+			const LONG left = static_cast<LONG> (self->until - GetTickCount());
+			return WaitForSingleObject(self->done, std::max<LONG> (left, 0) + max_linger) == WAIT_OBJECT_0;
+		}
+
+		// other thread has taken all waiters and is putting self back
+		Sleep(0);
+	}
+}
+
+backend::waiter* backend::spare()
+{
+	{
+		const sync::scoped_lock& g = sync::acquire(spare_lock_);
+		if (!spare_.empty())
+		{
+			waiter* const w = spare_.back();
+			spare_.pop_back();
+			return w;
+		}
+	} // free spare_lock_
+
+	std::auto_ptr<waiter> w(new waiter);
+	w->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (w->done == NULL)
+		throw sync::error("CreateEvent failed");
+	return w.release();
+}
+
+void backend::recycle(waiter* w)
+{
+	ResetEvent(w->done);
+	try
+	{
+		const sync::scoped_lock& g = sync::acquire(spare_lock_);
+		spare_.push_back(w);
+	}
+	catch (const std::exception&)
+	{
+		CloseHandle(w->done);
+		delete w;
+	}
+}
+
+bool backend::signal(const std::vector<waiter*>& batch, const waiter* self)
+{
+	// waiter belongs to other thread and must not be touched after it's signaled
+	bool result = false;
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		if (batch[i] == self)
+			result = true;
+		else
+			SetEvent(batch[i]->done);
+	}
+
+	return result;
+}
+
+void backend::serve(session& s, const config& c, waiter* self, bool& served, const deadline& d)
+{
+	// caller must own lock of s
+	if (self->done == NULL)
+	{
+		verify(s, c, &self, 1, d);
+		served = true;
+		return;
+	}
+
+	// take all waiters, which might include self
+	waiter* w = pop_all();
+	bool mine = false;
+	for (const waiter* i = w; i != NULL && !mine; i = i->next)
+		mine = (i == self);
+
+	// without pipelining, other waiters are better served by other connections
+	size_t depth = 1;
+	if (!(c.verify_vrfy && vrfy_ != 0) && (s.get() == NULL || s->pipelining()))
+		depth = std::max<size_t> (1, std::min<size_t> (c.pipeline_depth, max_pipeline));
+
+	std::vector<waiter*> batch;
+	try
+	{
+		batch.reserve(depth);
+	}
+	catch (...)
+	{
+		// nothing taken yet
+		while (w != NULL)
+		{
+			waiter* const next = w->next;
+			push(w);
+			w = next;
+		}
+		throw;
+	}
+
+	// self and oldest of others, up to pipeline depth. Others are claimed,
+	// so that their owners know they will be signaled before deadline of this
+	// thread; waiters not claimed are put back for threads holding other
+	// connections, each with its own deadline
+	const DWORD until = GetTickCount() + d.ms();
+	while (w != NULL)
+	{
+		waiter* const next = w->next;
+		if (w == self)
+		{
+			mine = false;
+			batch.push_back(w);
+		}
+		else if (batch.size() + (mine ? 1 : 0) < depth)
+		{
+			w->until = until;
+			InterlockedExchange(&w->claimed, 1);
+			batch.push_back(w);
+		}
+		else
+			push(w);
+		w = next;
+	}
+
+	// all waiters taken must be signaled, even on exception. Single deadline
+	// of this thread applies to all of them
+	try
+	{
+		if (!batch.empty())
+			verify(s, c, &batch[0], batch.size(), d);
+	}
+	catch (...)
+	{
+		served = signal(batch, self);
+		throw;
+	}
+
+	served = signal(batch, self);
+}
+
+bool backend::verify(const config& c, const std::string& rcpt, bool& allow)
+{
+	// domain which treats all recipients the same is answered without asking
+	const size_t at = rcpt.rfind('@');
+	if (at != std::string::npos && learned(c, rcpt.c_str() + at + 1, allow))
+		return true;
+
+	// wait for connection, connect, RSET, VRFY or MAIL and RCPT, all within
+	// single time limit
+	const deadline d(c.request_max_delay);
+
+	// waiter with event is reused by other threads, once no thread can see it
+	waiter local = {NULL, &rcpt, false, false, NULL, 0, 0};
+	waiter* w = &local;
+	if (c.pipeline_depth > 1)
+	{
+		w = spare();
+		const HANDLE done = w->done;
+		*w = local;
+		w->done = done;
+		push(w);
+	}
+
+	const size_t first = static_cast<unsigned long> (InterlockedIncrement(&next_)) % sessions_.size;
+	bool taken = false;
+	bool served = false;
+	bool signaled = false;
+	try
+	{
+		// wait for session until deadline. Release of session wakes one
+		// waiter; other thread might also take w and verify it meanwhile
+		const HANDLE events[2] = {*released_, w->done};
+		const DWORD n = (w->done == NULL ? 1 : 2);
+		stats::scope s_wait(p_wait);
+		for (bool waited = false; !taken; waited = true)
+		{
+			session* s = NULL;
+			const sync::scoped_lock& g = take(first, s);
+			if (g.active())
+			{
+				if (waited)
+					s_wait.stop();
+				else
+					s_wait.cancel();
+
+				taken = true;
+				serve(*s, c, w, served, d);
+				g.unlock();
+				SetEvent(*released_);
+			}
+			else if (d.expired())
+				break;
+			else if (WaitForMultipleObjects(n, events, FALSE, std::min(d.ms(), max_poll)) == WAIT_OBJECT_0 + 1)
+			{
+				signaled = true;
+				break;
+			}
+		}
+	}
+	catch (...)
+	{
+		// other thread might be still verifying w
+		if (w->done != NULL && (served || leave(w)))
+			recycle(w);
+		throw;
+	}
+
+	// recipient might have been taken by other thread. If it was not
+	// signaled in time, waiter is left to that thread and never reused
+	if (w->done != NULL && !served && !signaled && !leave(w))
+		return false;
+
+	allow = w->allow;
+	const bool result = w->verified;
+	if (w->done != NULL)
+		recycle(w);
+	return result;
+}
+
+size_t backend::verify_batch(const config& c, recipient* rcpts, size_t count, const deadline& d)
+{
+	// recipients in domains treating all the same are answered without asking
+	std::vector<waiter> waiters;
+	std::vector<waiter*> batch;
+	waiters.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		rcpts[i].verified = false;
+		const size_t at = rcpts[i].rcpt.rfind('@');
+		if (at != std::string::npos && learned(c, rcpts[i].rcpt.c_str() + at + 1, rcpts[i].allow))
+		{
+			rcpts[i].verified = true;
+			continue;
+		}
+
+		const waiter w = {NULL, &rcpts[i].rcpt, false, false, NULL, 0, 0};
+		waiters.push_back(w);
+	}
+
+	for (size_t i = 0; i < waiters.size(); ++i)
+		batch.push_back(&waiters[i]);
+
+	// one share for each connection, first one verified by this thread
+	const size_t n = std::min(sessions_.size, batch.size());
+	const size_t first = static_cast<unsigned long> (InterlockedIncrement(&next_)) % sessions_.size;
+	std::vector<share> shares(n);
+	std::vector<HANDLE> threads;
+	for (size_t i = 0; i < n; ++i)
+	{
+		const size_t begin = batch.size() * i / n;
+		const size_t end = batch.size() * (i + 1) / n;
+		const share s = {this, &c, &d, (first + i) % sessions_.size, &batch[0] + begin, end - begin};
+		shares[i] = s;
+	}
+
+	for (size_t i = 1; i < n; ++i)
+	{
+		DWORD id = 0;
+		const HANDLE t = CreateThread(NULL, 0, &share_thread, &shares[i], 0, &id);
+		if (t == NULL)
+		{
+			// shares not started are verified by this thread, one after another
+			for (; i < n; ++i)
+				share_thread(&shares[i]);
+			break;
+		}
+		threads.push_back(t);
+	}
+
+	if (n != 0)
+		share_thread(&shares[0]);
+	// each share ends soon after deadline. There might be more threads than
+	// WaitForMultipleObjects can take
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+
+	size_t result = 0;
+	for (size_t i = 0, j = 0; i < count; ++i)
+	{
+		if (!rcpts[i].verified)
+		{
+			rcpts[i].verified = waiters[j].verified;
+			rcpts[i].allow = waiters[j].allow;
+			++j;
+		}
+
+		if (rcpts[i].verified)
+			++result;
+	}
+
+	return result;
+}
+
+void backend::reset()
+{
+	InterlockedExchange(&vrfy_, 1);
+
+	for (size_t i = 0; i < sessions_.size; ++i)
+	{
+		const sync::scoped_lock& g = sync::acquire(sessions_[i]);
+		sessions_[i].reset();
+	}
+}
@@ -0,0 +1,159 @@
+// backend.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "catchall.hpp"
+#include "config.hpp"
+#include "smtp.hpp"
+#include "util.hpp"
+#include "util_ptr.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Set of connections to internal SMTP server. IIS may create multiple
+// instances of sink (e.g. one for each SMTP virtual server), thus backends
+// are kept in process-wide registry, keyed on address of internal server
+// and protocol settings. All sinks using the same internal server with the
+// same settings will share connections. Backend is reference counted, it
+// will be removed from registry and disconnected when last user is gone.
+// If pipelining is enabled, recipients are first pushed to lock-free stack
+// of waiters. Thread which gets connection takes up to pipeline depth of
+// waiters (itself first) and verifies them with pipelined MAIL and RCPT
+// commands; others are left for other connections. Threads of waiters
+// wait until their waiter is verified or they get connection, whichever
+// comes first; thus number of verifications per connection grows with
+// number of concurrent threads. Waiter taken by other thread is claimed,
+// and its owner waits for it no longer than until deadline of that thread.
+class backend
+{
+public:
+	// key in registry
+	struct key
+	{
+		unsigned long				server_address;
+		unsigned short				server_port;
+		std::string					protocol_helo;
+		std::string					protocol_from;
+		unsigned int				conn_idle_timeout;
+		unsigned int				conn_max_time;
+		unsigned int				connections;
+		unsigned int				pipeline_depth;
+
+		explicit key(const config& c);
+
+		friend bool operator< (const key& lh, const key& rh);
+	};
+
+	// recipient of verify_batch and its verdict
+	struct recipient
+	{
+		std::string					rcpt;		// canonical address
+		bool						verified;	// false if not completed
+		bool						allow;
+	};
+
+	// reference to backend, will find (or create) one in registry
+	class ref
+	{
+		backend*					ptr_;
+
+	public:
+		ref() : ptr_(NULL) {}
+		explicit ref(const config& c);
+		ref(const ref& rh);
+		~ref();
+
+		ref& operator=(const ref& rh);
+
+		backend* operator->() const {return ptr_;}
+		backend* get() const {return ptr_;}
+	};
+
+private:
+	// non-copyable and non-assignable
+	backend(const backend&);
+	backend& operator=(const backend&);
+
+	typedef sync::ptr<smtp, win32::critical_section> session;
+
+	// recipient waiting for verification, see serve
+	struct waiter
+	{
+		waiter*						next;
+		const std::string*			rcpt;
+		bool						verified;
+		bool						allow;
+		HANDLE						done;		// NULL if pipelining is disabled
+		volatile LONG				claimed;	// 1 if taken for verification
+		DWORD						until;		// GetTickCount() of deadline of claiming thread
+	};
+
+	// part of batch verified with single connection, see verify_batch
+	struct share
+	{
+		backend*					owner;
+		const config*				configuration;
+		const deadline*				limit;
+		size_t						first;		// session tried first
+		waiter* const*				batch;
+		size_t						count;
+	};
+
+	const key						key_;
+	const config					config_;
+	volatile LONG					refs_;
+	volatile LONG					next_;
+	volatile LONG					vrfy_;		// 0 if server does not support VRFY
+	waiter* volatile				queue_;		// stack of waiters, newest first
+	win32::handle					released_;	// set when session is released
+	win32::critical_section			spare_lock_;	// guards spare_
+	std::vector<waiter*>			spare_;		// waiters not in use, with their events
+	util::array<session>			sessions_;
+	catchall						learned_;
+
+	explicit backend(const config& c);
+	~backend();
+
+	static backend* attach(const config& c);
+	static void detach(backend* b);
+
+	bool query(smtp& s, const config& c, const std::string& rcpt, bool& allow, const deadline& d);
+	bool learned(const config& c, const char* domain, bool& allow);
+	void learn(smtp& s, const config& c, const char* domain, unsigned int code, const deadline& d);
+
+	void query(smtp& s, const config& c, waiter* const* batch, size_t count, const deadline& d);
+
+	void verify(session& s, const config& c, waiter* const* batch, size_t count, const deadline& d);
+	void verify_share(const config& c, size_t first, waiter* const* batch, size_t count, const deadline& d);
+	static DWORD WINAPI share_thread(void* pv);
+	sync::lock<win32::critical_section> take(size_t first, session*& s);
+	void push(waiter* w);
+	waiter* pop_all();
+	bool withdraw(waiter* self);
+	bool leave(waiter* self);
+	waiter* spare();
+	void recycle(waiter* w);
+	void serve(session& s, const config& c, waiter* self, bool& served, const deadline& d);
+	static bool signal(const std::vector<waiter*>& batch, const waiter* self);
+
+public:
+	// verify recipient using one of connections, preferably the one not in
+	// use by other thread. If all are busy, waits for one until deadline.
+	// Returns false if verification was not completed
+	bool verify(const config& c, const std::string& rcpt, bool& allow);
+
+	// verify many recipients, split among all connections. Each connection
+	// verifies its share in groups sent with single write, if pipelining is
+	// enabled and supported. Share waits for connection not longer than
+	// until deadline; recipients not verified before deadline are left with
+	// verified set to false. Returns number of recipients verified
+	size_t verify_batch(const config& c, recipient* rcpts, size_t count, const deadline& d);
+
+	// disconnect all sessions and forget that server does not support VRFY,
+	// e.g. on forced configuration refresh
+	void reset();
+};
@@ -0,0 +1,276 @@
+// bulk.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "bulk.hpp"
+#include "address.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+
+namespace
+{
+
+const size_t max_batch = 1000;
+const char* const csv_header = "address,result\r\n";
+
+inline bool blank(char ch)
+{
+	return static_cast<unsigned char> (ch) <= ' ';
+}
+
+// next line which is not blank nor comment, trimmed. False at end of data
+bool next_line(const char*& p, const char* end, const char*& first, const char*& last)
+{
+	while (p != end)
+	{
+		const char* eol = static_cast<const char*> (memchr(p, '\n', end - p));
+		if (eol == NULL)
+			eol = end;
+
+		first = p;
+		last = eol;
+		p = (eol == end ? eol : eol + 1);
+
+		while (first != last && blank(*first))
+			++first;
+		while (last != first && blank(*(last - 1)))
+			--last;
+		if (first != last && *first != '#')
+			return true;
+	}
+
+	return false;
+}
+
+// field containing comma or quote is quoted, and its quotes doubled
+void append_csv(std::string& out, const char* first, const char* last, const char* result)
+{
+	if (std::find(first, last, ',') == last && std::find(first, last, '"') == last)
+		out.append(first, last);
+	else
+	{
+		out += '"';
+		for (; first != last; ++first)
+		{
+			if (*first == '"')
+				out += '"';
+			out += *first;
+		}
+		out += '"';
+	}
+
+	out += ',';
+	out += result;
+	out += "\r\n";
+}
+
+void append_json(std::string& out, const char* first, const char* last, const char* result)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out += "{\"address\":\"";
+	for (; first != last; ++first)
+	{
+		const unsigned char ch = static_cast<unsigned char> (*first);
+		if (ch == '"' || ch == '\\')
+			out += '\\';
+		else if (ch < ' ')
+		{
+			out += "\\u00";
+			out += hex[ch >> 4];
+			out += hex[ch & 0xF];
+			continue;
+		}
+		out += *first;
+	}
+
+	out += "\",\"result\":\"";
+	out += result;
+	out += "\"}\r\n";
+}
+
+void read_file(const char* name, std::vector<char>& data)
+{
+	const HANDLE h = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		throw bulk::error("Unable to open list of addresses");
+	win32::handle f(h);
+
+	const DWORD size = GetFileSize(h, NULL);
+	if (size == INVALID_FILE_SIZE)
+		throw bulk::error("Unable to read list of addresses");
+
+	data.resize(size);
+	DWORD read = 0;
+	if (size != 0 && (!ReadFile(h, &data[0], size, &read, NULL) || read != size))
+		throw bulk::error("Unable to read list of addresses");
+}
+
+// count complete lines of results, and cut off line written partially when
+// previous run was interrupted
+unsigned long resume(HANDLE h)
+{
+	const DWORD size = GetFileSize(h, NULL);
+	if (size == INVALID_FILE_SIZE)
+		throw bulk::error("Unable to read results");
+
+	std::vector<char> data(size);
+	DWORD read = 0;
+	if (size != 0 && (!ReadFile(h, &data[0], size, &read, NULL) || read != size))
+		throw bulk::error("Unable to read results");
+
+	unsigned long lines = 0;
+	DWORD complete = 0;
+	for (DWORD i = 0; i < size; ++i)
+	{
+		if (data[i] == '\n')
+		{
+			++lines;
+			complete = i + 1;
+		}
+	}
+
+	if (SetFilePointer(h, static_cast<LONG> (complete), NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER
+		|| !SetEndOfFile(h))
+		throw bulk::error("Unable to write results");
+	return lines;
+}
+
+void write(HANDLE h, const std::string& data)
+{
+	DWORD written = 0;
+	if (!data.empty() && (!WriteFile(h, data.data(), static_cast<DWORD> (data.size()), &written, NULL) || written != data.size()))
+		throw bulk::error("Unable to write results");
+}
+
+} // unnamed namespace
+
+namespace bulk
+{
+
+summary verify(const config& c, const backend::ref& b, const char* source, const char* target, unsigned int rate)
+{
+	summary result;
+	memset(&result, 0, sizeof(result));
+
+	std::vector<char> data;
+	read_file(source, data);
+
+	const HANDLE h = CreateFileA(target, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		throw error("Unable to open results");
+	win32::handle f(h);
+
+	const size_t len = strlen(target);
+	const bool json = len >= 6 && _stricmp(target + len - 6, ".jsonl") == 0;
+	unsigned long done = resume(h);
+	if (!json && done == 0)
+		write(h, csv_header);
+	else if (!json)
+		--done;
+
+	const char* p = data.empty() ? NULL : &data[0];
+	const char* const end = p + data.size();
+	const char* first = NULL;
+	const char* last = NULL;
+	for (; result.skipped < done && next_line(p, end, first, last); ++result.skipped)
+		;
+
+	// batch is split among connections, each verifying its share in groups
+	// (see 65591) which must fit in time limit of single verification
+	const size_t connections = std::max(c.connections, 1U);
+	const size_t depth = std::max(c.pipeline_depth, 1U);
+	const size_t size = rate != 0 ? std::min<size_t> (rate, max_batch) : max_batch;
+
+	typedef std::pair<const char*, const char*> line;
+	std::vector<line> lines;
+	std::vector<backend::recipient> rcpts;
+	std::vector<size_t> index;	// in rcpts, or ~0 for invalid address
+	std::string out;
+	const timer t;
+	unsigned long processed = 0;
+	for (;;)
+	{
+		lines.clear();
+		rcpts.clear();
+		index.clear();
+		while (lines.size() < size && next_line(p, end, first, last))
+		{
+			lines.push_back(line(first, last));
+
+			const char* begin = NULL;
+			const char* finish = NULL;
+			if (address::parse(first, last - first, begin, finish) != address::valid || *begin == '<')
+			{
+				index.push_back(~static_cast<size_t> (0));
+				continue;
+			}
+
+			index.push_back(rcpts.size());
+			rcpts.push_back(backend::recipient());
+			rcpts.back().rcpt = c.canonical(std::string(begin, finish));
+		}
+
+		if (lines.empty())
+			break;
+
+		if (!rcpts.empty())
+		{
+			const size_t groups = (rcpts.size() + connections * depth - 1) / (connections * depth);
+			const deadline d(static_cast<unsigned long> (c.request_max_delay * groups));
+			const timer batch;
+			b->verify_batch(c, &rcpts[0], rcpts.size(), d);
+			result.slowest = std::max(result.slowest, static_cast<unsigned long> (batch.ms()));
+			++result.batches;
+		}
+
+		out.clear();
+		for (size_t i = 0; i < lines.size(); ++i)
+		{
+			const char* verdict = "invalid";
+			if (index[i] == ~static_cast<size_t> (0))
+				++result.invalid;
+			else if (!rcpts[index[i]].verified)
+			{
+				verdict = "unverified";
+				++result.unverified;
+			}
+			else if (rcpts[index[i]].allow)
+			{
+				verdict = "accepted";
+				++result.accepted;
+			}
+			else
+			{
+				verdict = "rejected";
+				++result.rejected;
+			}
+
+			if (json)
+				append_json(out, lines[i].first, lines[i].second, verdict);
+			else
+				append_csv(out, lines[i].first, lines[i].second, verdict);
+		}
+
+		// results are written after each batch, so that little is lost if interrupted
+		write(h, out);
+
+		processed += static_cast<unsigned long> (lines.size());
+		if (rate != 0)
+		{
+			const __int64 due = (1000LL * processed) / rate;
+			const __int64 now = t.ms();
+			if (due > now)
+				Sleep(static_cast<DWORD> (due - now));
+		}
+	}
+
+	result.elapsed = static_cast<unsigned long> (t.ms());
+	return result;
+}
+
+} // namespace bulk
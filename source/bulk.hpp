@@ -0,0 +1,42 @@
+// bulk.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "backend.hpp"
+#include "config.hpp"
+
+// Verification of long list of addresses, e.g. of mailing list before it
+// is cleaned. Addresses are read from text file, one per line, verified
+// in batches split among all connections to internal server (see
+// backend::verify_batch) and results are appended to target file in the
+// same order: as CSV, or as JSON lines if name of target ends with ".jsonl".
+// Each address gives exactly one line of results, thus interrupted run is
+// resumed by skipping as many addresses as there are lines in target.
+namespace bulk
+{
+
+struct error : public std::runtime_error
+{
+	explicit error(const char* msg) : std::runtime_error(msg) {}
+};
+
+struct summary
+{
+	unsigned long				skipped;	// verified by previous run
+	unsigned long				accepted;
+	unsigned long				rejected;
+	unsigned long				unverified;	// not verified in time
+	unsigned long				invalid;
+	unsigned long				batches;
+	unsigned long				elapsed;	// milliseconds
+	unsigned long				slowest;	// milliseconds, of slowest batch
+};
+
+// rate is maximum number of addresses verified per second, 0 for no limit
+summary verify(const config& c, const backend::ref& b, const char* source, const char* target, unsigned int rate);
+
+} // namespace bulk
@@ -0,0 +1,199 @@
+// cache.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "cache.hpp"
+
+namespace
+{
+
+// shared by IIS and front-ends started in other sessions, see service
+const char* const mapping_prefix = "Global\\rcptproxy.cache.";
+const char* const mutex_prefix = "Global\\rcptproxy.cache.lock.";
+
+const unsigned long min_capacity = 1024;
+// mapped view must fit in address space of 32-bit process (inetinfo.exe)
+const unsigned long max_size = 0x10000000;	// 256MB
+
+// name of kernel objects shared by all users of the same file
+std::string name(const char* prefix, const std::string& path)
+{
+	std::string lpath(path);
+	str::lower(lpath);
+
+	std::string result;
+	str::format(result, "%s%.08X", prefix, static_cast<unsigned long> (str::hash(lpath) >> 32));
+	return result;
+}
+
+} // unnamed namespace
+
+unsigned long cache::rounded(unsigned long capacity)
+{
+	const unsigned long max_capacity = (max_size - sizeof(header)) / sizeof(record) / shards * shards;
+	capacity = std::min(std::max(capacity, min_capacity), max_capacity);
+	return (capacity + shards - 1) / shards * shards;
+}
+
+cache::cache(const std::string& path, unsigned long capacity) :
+	path_(path),
+	capacity_(rounded(capacity)),
+	shard_size_(capacity_ / shards),
+	view_(NULL),
+	header_(NULL),
+	records_(NULL)
+{
+	const std::string lock = name(mutex_prefix, path_);
+	lock_.reset(new win32::mutex(lock.c_str()));
+	for (unsigned int i = 0; i < shards; ++i)
+	{
+		std::string n;
+		str::format(n, "%s.%u", lock.c_str(), i);
+		locks_[i].reset(new win32::mutex(n.c_str()));
+	}
+
+	const unsigned __int64 size = sizeof(header) + static_cast<unsigned __int64> (capacity_) * sizeof(record);
+	HANDLE file = INVALID_HANDLE_VALUE;
+	if (!path_.empty())
+	{
+		file = CreateFileA(path_.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			throw error("Unable to open cache file");
+		file_ = file;
+	}
+
+	// file will grow if it's smaller than size
+	mapping_ = CreateFileMappingA(file, NULL, PAGE_READWRITE, static_cast<DWORD> (size >> 32),
+		static_cast<DWORD> (size), name(mapping_prefix, path_).c_str());
+	if (*mapping_ == NULL)
+		throw error("Unable to create cache file mapping");
+
+	view_ = MapViewOfFile(*mapping_, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T> (size));
+	if (view_ == NULL)
+		throw error("Unable to map cache file");
+
+	header_ = static_cast<header*> (view_);
+	records_ = reinterpret_cast<record*> (header_ + 1);
+
+	const sync::scoped_lock& g = sync::acquire(*lock_);
+	if (header_->magic != magic_ || header_->version != version
+		|| header_->record_size != sizeof(record) || header_->capacity != capacity_)
+		init();
+}
+
+cache::~cache()
+{
+	// dirty pages will be written to the file by the system
+	if (view_ != NULL)
+		UnmapViewOfFile(view_);
+}
+
+void cache::init()
+{
+	// invalidate header first, in case someone else is reading it right now
+	header_->magic = 0;
+	for (unsigned long i = 0; i < capacity_; ++i)
+	{
+		records_[i].check = 0;
+		records_[i].key = 0;
+		records_[i].expires = 0;
+		records_[i].referenced = 0;
+		records_[i].reserved = 0;
+	}
+
+	header_->version = version;
+	header_->record_size = sizeof(record);
+	header_->capacity = capacity_;
+	header_->magic = magic_;
+}
+
+bool cache::find(unsigned __int64 key, bool& allow, unsigned long& left) const
+{
+	// other process might be initializing file with different layout
+	if (header_->magic != magic_ || header_->capacity != capacity_)
+		return false;
+
+	const unsigned long t = now();
+	record* const base = records_ + shard(key) * shard_size_;
+	const unsigned long first = static_cast<unsigned long> (key % shard_size_);
+	for (unsigned int i = 0; i < probe_; ++i)
+	{
+		record& r = base[(first + i) % shard_size_];
+		const unsigned long check = r.check;
+		const unsigned __int64 k = r.key;
+		const unsigned long expires = r.expires;
+
+		if (k == 0)
+			return false;
+		else if (k != key)
+			continue;
+
+		// record might have been modified while we were reading it
+		if (r.check != check || checksum(k, expires, (check & 1) != 0) != check)
+			return false;
+		if (expires <= t)
+			return false;
+
+		// mark for second chance, but avoid dirtying cache line if already marked
+		if (r.referenced == 0)
+			r.referenced = 1;
+
+		allow = (check & 1) != 0;
+		left = expires - t;
+		return true;
+	}
+
+	return false;
+}
+
+void cache::insert(unsigned __int64 key, bool allow, unsigned long ttl)
+{
+	const unsigned long t = now();
+	const unsigned long expires = t + ttl;
+	const unsigned int s = shard(key);
+	record* const base = records_ + s * shard_size_;
+	const unsigned long first = static_cast<unsigned long> (key % shard_size_);
+
+	const sync::scoped_lock& g = sync::acquire(*locks_[s]);
+	if (header_->magic != magic_ || header_->capacity != capacity_)
+		return;
+
+	// update existing record, or take over empty or expired one
+	record* dest = NULL;
+	for (unsigned int i = 0; i < probe_; ++i)
+	{
+		record& r = base[(first + i) % shard_size_];
+		if (r.key == key)
+		{
+			dest = &r;
+			break;
+		}
+		else if (dest == NULL && (r.key == 0 || r.expires <= t))
+			dest = &r;
+	}
+
+	// otherwise evict with second chance: sweep probing window from its
+	// start, clearing marks of records found since last sweep, and stop at
+	// first unmarked one. After full window all marks are cleared, thus
+	// second pass will stop
+	for (unsigned int i = 0; dest == NULL && i < 2 * probe_; ++i)
+	{
+		record& r = base[(first + i % probe_) % shard_size_];
+		if (r.referenced != 0)
+			r.referenced = 0;
+		else
+			dest = &r;
+	}
+
+	// zeroed check makes record invalid for readers while it's being modified
+	dest->check = 0;
+	dest->key = key;
+	dest->expires = expires;
+	dest->referenced = 0;
+	dest->check = checksum(key, expires, allow);
+}
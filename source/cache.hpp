@@ -0,0 +1,131 @@
+// cache.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Cache of verdicts received from internal SMTP server, kept in memory
+// mapped file. That's open addressing hash table of fixed size records,
+// each one holding 64-bit hash of recipient address (in place of address
+// itself), expiration time and verdict. Since the file survives restarts
+// of IIS and named file mapping is shared, all instances of sink (also in
+// different processes) use the same table.
+// Lookups do not take any locks - record is written in such a way that
+// reader can always tell if it has been modified while being read. Table
+// is split into shards, each one with its own named mutex serializing
+// writers, thus writers of different shards do not wait for each other.
+// When there is no free slot within probing distance, record is evicted
+// with second chance algorithm: readers mark records they have found, and
+// writer sweeps probing window of the key, clearing marks, and takes over
+// first unmarked record.
+class cache
+{
+public:
+	struct error : public std::runtime_error
+	{
+		explicit error(const char* msg) : std::runtime_error(msg) {}
+	};
+
+	// update when layout or meaning of file changes; all records written
+	// by other version will be discarded
+	static const unsigned long version = 3;
+	static const unsigned int shards = 16;
+
+private:
+	// non-copyable and non-assignable
+	cache(const cache&);
+	cache& operator=(const cache&);
+
+	static const unsigned long magic_ = 0x43504352; // "RCPC"
+	static const unsigned int probe_ = 16;
+
+	struct header
+	{
+		unsigned long					magic;
+		unsigned long					version;
+		unsigned long					record_size;
+		unsigned long					capacity;
+	};
+
+	struct record
+	{
+		volatile unsigned __int64		key;		// 0 means empty slot
+		volatile unsigned long			expires;	// time() of expiration
+		volatile unsigned long			check;		// checksum and verdict
+		volatile unsigned long			referenced;	// second chance, set by readers
+		unsigned long					reserved;
+	};
+
+	const std::string					path_;
+	const unsigned long					capacity_;	// multiple of shards
+	const unsigned long					shard_size_;
+	win32::handle						file_;
+	win32::handle						mapping_;
+	std::auto_ptr<win32::mutex>			lock_;		// held by init
+	std::auto_ptr<win32::mutex>			locks_[shards];
+	void*								view_;
+	header*								header_;
+	record*								records_;
+
+	static unsigned long checksum(unsigned __int64 key, unsigned long expires, bool allow)
+	{
+		unsigned long h = static_cast<unsigned long> (key ^ (key >> 32)) ^ expires;
+		h = ((h >> 16) ^ h) * 0x45D9F3BUL;
+		h = ((h >> 16) ^ h) * 0x45D9F3BUL;
+		h = (h >> 16) ^ h;
+
+		// bit 1 is always set, thus zeroed check is never valid
+		return (h & ~3UL) | 2UL | (allow ? 1UL : 0UL);
+	}
+
+	static unsigned long now()
+	{
+		return static_cast<unsigned long> (time(NULL));
+	}
+
+	void init();
+
+	// capacity rounded up, so that all shards have the same size
+	static unsigned long rounded(unsigned long capacity);
+
+	// shard is chosen by top bits of the key, slot within shard by the rest
+	static unsigned int shard(unsigned __int64 key)
+	{
+		return static_cast<unsigned int> (key >> 60) % shards;
+	}
+
+public:
+	// empty path means cache in system paging file, which is shared but
+	// does not survive restart of IIS. Capacity is number of records, each
+	// one taking 24 bytes
+	cache(const std::string& path, unsigned long capacity);
+
+	~cache();
+
+	bool matches(const std::string& path, unsigned long capacity) const
+	{
+		return path_ == path && capacity_ == rounded(capacity);
+	}
+
+	// returns true if verdict for given key has been found and is not
+	// expired; left is number of seconds until it expires
+	bool find(unsigned __int64 key, bool& allow, unsigned long& left) const;
+
+	// store verdict for ttl seconds
+	void insert(unsigned __int64 key, bool allow, unsigned long ttl);
+
+	// key of recipient address verified by given internal server
+	static unsigned __int64 key(unsigned long server_address, unsigned short server_port, const std::string& rcpt)
+	{
+		unsigned __int64 seed = (static_cast<unsigned __int64> (version) << 48)
+			^ (static_cast<unsigned __int64> (server_port) << 32) ^ server_address;
+		unsigned __int64 result = str::hash(rcpt, seed);
+		return result != 0 ? result : 1;
+	}
+};
@@ -0,0 +1,100 @@
+// catchall.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "catchall.hpp"
+#include "util.hpp"
+
+unsigned __int64 catchall::key(const char* domain)
+{
+	const unsigned __int64 result = str::hash(domain, strlen(domain));
+	return result != 0 ? result : 1;
+}
+
+catchall::entry* catchall::find(shard& s, unsigned __int64 k, bool insert)
+{
+	// caller must own lock of s
+	const unsigned int first = static_cast<unsigned int> ((k >> 4) % slots);
+	const DWORD now = GetTickCount();
+	entry* e = NULL;
+	for (unsigned int i = 0; i < probe; ++i)
+	{
+		entry& t = s.entries[(first + i) % slots];
+		if (t.key == k)
+			return &t;
+		else if (t.key == 0)
+		{
+			if (!insert)
+				return NULL;
+			e = &t;
+			break;
+		}
+
+		// take over least recently used entry
+		if (e == NULL || now - t.stamp > now - e->stamp)
+			e = &t;
+	}
+
+	if (!insert)
+		return NULL;
+
+	e->key = k;
+	e->stamp = now;
+	e->expires = now;
+	e->state = unknown;
+	e->last = false;
+	e->streak = 0;
+	return e;
+}
+
+catchall::verdict catchall::find(const char* domain)
+{
+	const unsigned __int64 k = key(domain);
+	shard& s = shards_[k % shards];
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	const entry* e = find(s, k, false);
+	if (e == NULL || static_cast<LONG> (e->expires - GetTickCount()) <= 0)
+		return unknown;
+
+	return e->state;
+}
+
+bool catchall::observe(const char* domain, bool allow, unsigned int threshold)
+{
+	const unsigned __int64 k = key(domain);
+	shard& s = shards_[k % shards];
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	entry& e = *find(s, k, true);
+	const DWORD now = GetTickCount();
+	e.stamp = now;
+	if (e.streak != 0 && e.last == allow)
+		++e.streak;
+	else
+	{
+		e.last = allow;
+		e.streak = 1;
+	}
+
+	if (e.state != unknown && static_cast<LONG> (e.expires - now) <= 0)
+		e.state = unknown;
+
+	return e.state == unknown && e.streak >= threshold;
+}
+
+void catchall::classify(const char* domain, verdict v, unsigned int ttl)
+{
+	const unsigned __int64 k = key(domain);
+	shard& s = shards_[k % shards];
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	entry& e = *find(s, k, true);
+	e.state = v;
+	e.expires = GetTickCount() + 1000UL * ttl;
+	e.streak = 0;
+}
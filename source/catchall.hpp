@@ -0,0 +1,77 @@
+// catchall.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Behavior of domains hosted by internal SMTP server, learned from its
+// verdicts. Domain which gave the same verdict to threshold recipients in
+// a row is candidate to be classified as accepting (catch-all) or
+// rejecting all recipients; the classification holds for given time, and
+// recipients in such domain need not be verified. Entries are kept in
+// fixed number of shards, each one having its own lock and fixed number
+// of slots, just like in limiter.
+class catchall
+{
+public:
+	static const unsigned int shards = 16;
+	static const unsigned int slots = 256;		// in each shard
+	static const unsigned int probe = 8;		// max. probing distance
+
+	enum verdict
+	{
+		unknown,
+		normal,		// verdicts depend on recipient
+		accept_all,
+		reject_all
+	};
+
+private:
+	// non-copyable and non-assignable
+	catchall(const catchall&);
+	catchall& operator=(const catchall&);
+
+	static const unsigned int spin_ = 4000;
+
+	struct entry
+	{
+		unsigned __int64			key;		// 0 means empty slot
+		DWORD						stamp;		// GetTickCount() of last verdict
+		DWORD						expires;	// GetTickCount() of expiration of state
+		verdict						state;
+		bool						last;		// last verdict
+		unsigned int				streak;		// count of last verdict in a row
+	};
+
+	struct shard
+	{
+		win32::critical_section		lock;
+		std::vector<entry>			entries;
+
+		shard() : lock(spin_), entries(slots) {}
+	};
+
+	shard							shards_[shards];
+
+	static unsigned __int64 key(const char* domain);
+	static entry* find(shard& s, unsigned __int64 k, bool insert);
+
+public:
+	catchall() {}
+
+	// classification of domain, unknown if it has expired
+	verdict find(const char* domain);
+
+	// count verdict of internal server. Returns true if domain should be
+	// classified now, that is it gave the same verdict threshold times in a
+	// row and it is not known to be normal
+	bool observe(const char* domain, bool allow, unsigned int threshold);
+
+	// classify domain for ttl seconds and start counting verdicts again
+	void classify(const char* domain, verdict v, unsigned int ttl);
+};
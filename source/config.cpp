@@ -10,6 +10,7 @@
 
 #include "util.hpp"
 #include "config.hpp"
+#include "address.hpp"
 
 namespace
 {
@@ -47,22 +48,102 @@ const char* const		dfrcp = "Unable to relay to @"; // ending space means "append
 const unsigned int		sfsts = 0x0001001A; // 65562
 const unsigned int		dfsts = 550;
 
-const unsigned int		max_string = 80;
-const unsigned int		sexcl_buffer = 800;
-const unsigned int		sexcl_size = 60;
-const unsigned int		max_ip = 16;
+const unsigned int		srate = 0x0001001B; // 65563
+const unsigned int		drate = 0; // no limit
 
+const unsigned int		sbrst = 0x0001001C; // 65564
+const unsigned int		dbrst = 0; // same as rate
+
+const unsigned int		ststs = 0x0001001D; // 65565
+const unsigned int		dtsts = 451;
+
+const unsigned int		stmsg = 0x0001001E; // 65566
+const char* const		dtmsg = "Too many recipients from your address, try again later";
+
+const unsigned int		shses = 0x0001001F; // 65567
+const unsigned int		dhses = 0; // disabled
+
+const unsigned int		shcli = 0x00010020; // 65568
+const unsigned int		dhcli = 0; // disabled
+
+const unsigned int		shwnd = 0x00010021; // 65569
+const unsigned int		dhwnd = 600;
+
+const unsigned int		shbls = 0x00010022; // 65570
+const unsigned int		dhbls = 3600;
+
+const unsigned int		sctim = 0x00010023; // 65571
+const unsigned int		dctim = 0; // disabled
+
+const unsigned int		scfil = 0x00010024; // 65572
+const char* const		dcfil = ""; // system paging file
+
+const unsigned int		scsiz = 0x00010025; // 65573
+const unsigned int		dcsiz = 65536;
+
+const unsigned int		sconn = 0x00010026; // 65574
+const unsigned int		dconn = 1;
+
+const unsigned int		ssubs = 0x00010027; // 65575
+const char* const		dsubs = ""; // disabled
+
+const unsigned int		salia = 0x00010028; // 65576
+
+const unsigned int		sfold = 0x00010029; // 65577
+const bool				dfold = true;
+
+const unsigned int		sstin = 0x0001002A; // 65578
+const unsigned int		dstin = 0; // disabled
+
+const unsigned int		sstfl = 0x0001002B; // 65579
+const char* const		dstfl = ""; // debug output
+
+const unsigned int		sexfl = 0x0001002C; // 65580
+const char* const		dexfl = ""; // disabled
+
+const unsigned int		sdoms = 0x0001002D; // 65581
+
+const unsigned int		sfpol = 0x0001002E; // 65582
+const bool				dfpol = true; // deny
+
+const unsigned int		sdirf = 0x0001002F; // 65583
+const char* const		ddirf = ""; // disabled
+
+const unsigned int		sltrh = 0x00010030; // 65584
+const unsigned int		dltrh = 0; // disabled
+
+const unsigned int		sltll = 0x00010031; // 65585
+const unsigned int		dltll = 3600;
+
+const unsigned int		slprb = 0x00010032; // 65586
+const bool				dlprb = true;
+
+const unsigned int		slpol = 0x00010033; // 65587
+
+const unsigned int		scstl = 0x00010034; // 65588
+const unsigned int		dcstl = 0; // disabled
+
+const unsigned int		scgrc = 0x00010035; // 65589
+const unsigned int		dcgrc = 0; // disabled
+
+const unsigned int		svrfy = 0x00010036; // 65590
+const bool				dvrfy = false;
+
+const unsigned int		sppln = 0x00010037; // 65591
+const unsigned int		dppln = 0; // disabled
+
+const unsigned int		max_string = MAX_PATH; // long enough for file name
+
+// values are found in data read by metabase::load, without round trip
 bool read(unsigned int& dest, metabase& md, unsigned int id)
 {
-	unsigned char buf[sizeof(DWORD)];
-	METADATA_RECORD record = {id, 0, 0, DWORD_METADATA, sizeof(buf), buf, 0};
-	DWORD size;
-	if (md.read(record, size, std::nothrow) == S_OK)
-	{
-		dest = *(reinterpret_cast<DWORD *> (record.pbMDData));
-		return true;
-	}
-	return false;
+	DWORD size = 0;
+	const unsigned char* data = md.find(id, DWORD_METADATA, size);
+	if (data == NULL || size < sizeof(DWORD))
+		return false;
+
+	dest = *(reinterpret_cast<const DWORD *> (data));
+	return true;
 }
 
 bool read(unsigned short& dest, metabase& md, unsigned int id)
@@ -85,21 +166,52 @@ bool read(bool& dest, metabase& md, unsigned int id)
 
 bool read(std::string& dest, metabase& md, unsigned int id)
 {
-	unsigned char buf[max_string * sizeof(wchar_t)];
-	METADATA_RECORD record = {id, 0, 0, STRING_METADATA, sizeof(buf), buf, 0};
-	DWORD size;
-	if (md.read(record, size, std::nothrow) == S_OK)
+	DWORD size = 0;
+	const unsigned char* data = md.find(id, STRING_METADATA, size);
+	if (data == NULL || size < sizeof(wchar_t) || size > max_string * sizeof(wchar_t))
+		return false;
+
+	char dest_buf[max_string];
+	int len = (size / sizeof(wchar_t)) - 1;
+	if (str::cast(dest_buf, reinterpret_cast<const wchar_t*>(data), len))
 	{
-		char dest_buf[max_string];
-		int len = (record.dwMDDataLen / sizeof(wchar_t)) - 1;
-		if (str::cast(dest_buf, reinterpret_cast<wchar_t*>(buf), len))
+		dest.assign(dest_buf, len);
+		return true;
+	}
+
+	return false;
+}
+
+bool read(std::vector<std::string>& dest, metabase& md, unsigned int id)
+{
+	DWORD size = 0;
+	const unsigned char* data = md.find(id, MULTISZ_METADATA, size);
+	if (data == NULL)
+		return false;
+
+	const wchar_t* wsz = reinterpret_cast<const wchar_t*> (data);
+	const wchar_t* const end = wsz + size / sizeof(wchar_t);
+
+	dest.clear();
+	while (wsz != end && *wsz != 0)
+	{
+		const wchar_t* const first = wsz;
+		while (wsz != end && *wsz != 0)
+			++wsz;
+
+		std::string tmp;
+		if (str::cast(tmp, first, wsz - first))
 		{
-			dest.assign(dest_buf, len);
-			return true;
+			str::trim(tmp);
+			if (!tmp.empty())
+				dest.push_back(tmp);
 		}
+
+		if (wsz != end)
+			++wsz;
 	}
 
-	return false;
+	return true;
 }
 
 template <typename Type>
@@ -146,50 +258,214 @@ const config::complete_t config::complete;
 
 void config::read_exclusions(metabase& md)
 {
-	unsigned char buf[sexcl_buffer * sizeof(wchar_t)];
-	METADATA_RECORD record = {sexcl, 0, 0, MULTISZ_METADATA, sizeof(buf), buf, 0};
-	DWORD size;
-	HRESULT hr = md.read(record, size, std::nothrow);
-	if (hr == S_OK)
-		size = 0;
-	else if (hr != HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+	std::vector<std::string> list;
+	if (!read(list, md, sexcl))
 		return;
 
-	const wchar_t* wsz = reinterpret_cast<const wchar_t*> (&buf[0]);
-	util::array<unsigned char> buf2(size);
-	if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+	const sync::scoped_lock& g = sync::acquire(exc_lock_);
+	exclusions_.reserve(list.size());
+	for (std::vector<std::string>::const_iterator i = list.begin(); i != list.end(); ++i)
 	{
-		record.dwMDDataLen = static_cast<DWORD> (buf2.size);
-		record.pbMDData = buf2;
-		if (md.read(record, size, std::nothrow) != S_OK)
-			return;
+		unsigned long ip = tcp::ip4_addr(i->c_str());
+		if (ip != tcp::ip4_none)
+			exclusions_.push_back(ip);
+	}
+
+	std::sort(exclusions_.begin(), exclusions_.end());
+	exclusions_.erase(std::unique(exclusions_.begin(), exclusions_.end()), exclusions_.end());
+}
+
+void config::read_aliases(metabase& md)
+{
+	std::vector<std::string> list;
+	if (!read(list, md, salia))
+		return;
 
-		wsz = reinterpret_cast<const wchar_t*> (record.pbMDData);
+	// each line is "alias=domain"
+	for (std::vector<std::string>::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		size_t eq = i->find('=');
+		if (eq == std::string::npos)
+			continue;
+
+		std::string alias = i->substr(0, eq);
+		std::string domain = i->substr(eq + 1);
+		str::trim(alias);
+		str::trim(domain);
+		str::lower(alias);
+		str::lower(domain);
+		if (!alias.empty() && !domain.empty())
+			aliases_.push_back(std::make_pair(alias, domain));
 	}
 
-	const sync::scoped_lock& g = sync::acquire(exc_lock_);
-	exclusions_.reserve(sexcl_size);
-	while (*wsz!= 0)
+	std::sort(aliases_.begin(), aliases_.end());
+}
+
+void config::read_domains(metabase& md)
+{
+	std::vector<std::string> list;
+	if (!read(list, md, sdoms))
+		return;
+
+	// ".example.com" matches example.com and all its subdomains
+	for (std::vector<std::string>::iterator i = list.begin(); i != list.end(); ++i)
 	{
-		unsigned long ip = tcp::ip4_addr(wsz);
-		if (ip != tcp::ip4_none)
-			exclusions_.push_back(ip);
+		address::lower(*i);
+		if ((*i)[0] != '.')
+			domains_.push_back(*i);
+		else if (i->size() > 1)
+			suffixes_.push_back(i->substr(1));
+	}
 
-		while (*wsz != 0)
-			++wsz;
-		++wsz;
+	std::sort(domains_.begin(), domains_.end());
+	domains_.erase(std::unique(domains_.begin(), domains_.end()), domains_.end());
+	std::sort(suffixes_.begin(), suffixes_.end());
+	suffixes_.erase(std::unique(suffixes_.begin(), suffixes_.end()), suffixes_.end());
+}
+
+namespace
+{
+	struct string_less
+	{
+		bool operator()(const std::string& lh, const char* rh) const
+		{
+			return lh.compare(rh) < 0;
+		}
+	};
+
+	bool contains(const std::vector<std::string>& sorted, const char* sz)
+	{
+		std::vector<std::string>::const_iterator i = std::lower_bound(sorted.begin(), sorted.end(), sz, string_less());
+		return i != sorted.end() && *i == sz;
 	}
 
-	std::sort(exclusions_.begin(), exclusions_.end());
-	std::vector<unsigned long>::iterator i = std::unique(exclusions_.begin(), exclusions_.end());
-	if (i != exclusions_.end())
-		exclusions_.erase(i);
+	struct policy_less
+	{
+		bool operator()(const std::pair<std::string, config::policy>& lh, const char* rh) const
+		{
+			return lh.first.compare(rh) < 0;
+		}
+	};
+} // unnamed namespace
+
+void config::read_policies(metabase& md)
+{
+	std::vector<std::string> list;
+	if (!read(list, md, slpol))
+		return;
+
+	// each line is "domain=accept", "domain=reject" or "domain=verify"
+	for (std::vector<std::string>::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		size_t eq = i->find('=');
+		if (eq == std::string::npos)
+			continue;
+
+		std::string domain = i->substr(0, eq);
+		std::string value = i->substr(eq + 1);
+		str::trim(domain);
+		str::trim(value);
+		address::lower(domain);
+		address::lower(value);
+
+		policy p = policy_learn;
+		if (value == "accept")
+			p = policy_accept;
+		else if (value == "reject")
+			p = policy_reject;
+		else if (value == "verify")
+			p = policy_verify;
+		if (!domain.empty() && p != policy_learn)
+			policies_.push_back(std::make_pair(domain, p));
+	}
+
+	std::sort(policies_.begin(), policies_.end());
+}
+
+config::policy config::learned_policy(const char* domain) const
+{
+	if (policies_.empty())
+		return policy_learn;
+
+	policy_map::const_iterator i = std::lower_bound(policies_.begin(), policies_.end(), domain, policy_less());
+	if (i != policies_.end() && i->first == domain)
+		return i->second;
+
+	return policy_learn;
+}
+
+bool config::is_hosted(const std::string& canonical) const
+{
+	if (domains_.empty() && suffixes_.empty())
+		return true;
+
+	// local recipient, e.g. postmaster
+	const size_t at = canonical.rfind('@');
+	if (at == std::string::npos)
+		return true;
+
+	const char* const domain = canonical.c_str() + at + 1;
+	if (contains(domains_, domain))
+		return true;
+
+	// "mail.example.com" is checked against "mail.example.com", "example.com" and "com"
+	if (suffixes_.empty())
+		return false;
+
+	for (const char* p = domain; p != NULL; p = strchr(p, '.'))
+	{
+		if (*p == '.')
+			++p;
+		if (contains(suffixes_, p))
+			return true;
+	}
+
+	return false;
+}
+
+std::string config::canonical(const std::string& rcpt) const
+{
+	const size_t at = rcpt.rfind('@');
+	std::string local = rcpt.substr(0, at);
+	std::string domain;
+	if (at != std::string::npos)
+	{
+		// domain is never case sensitive
+		domain = rcpt.substr(at + 1);
+		address::lower(domain);
+
+		alias_map::const_iterator i = std::lower_bound(aliases_.begin(), aliases_.end(), std::make_pair(domain, std::string()));
+		if (i != aliases_.end() && i->first == domain)
+			domain = i->second;
+	}
+
+	// "user+tag" becomes "user", but "+tag" remains intact
+	if (!subaddress_.empty())
+	{
+		size_t sep = local.find_first_of(subaddress_);
+		if (sep != std::string::npos && sep != 0)
+			local.erase(sep);
+	}
+
+	if (fold_local)
+		address::lower(local);
+
+	if (at == std::string::npos)
+		return local;
+
+	return local + '@' + domain;
 }
 
 config::config(metabase& mb) :
 	protocol_helo_(dhelo),
 	protocol_from_(dfrom),
 	rcpt_response_(dfrcp),
+	temp_response_(dtmsg),
+	cache_file_(dcfil),
+	subaddress_(dsubs),
+	stats_file_(dstfl),
+	exclusion_file_(dexfl),
+	directory_file_(ddirf),
 	refresh(read<bool>(mb, srefr, false)),
 	server_address(tcp::ip4_addr(read<std::string>(mb, saddr).c_str())),
 	server_port(read<unsigned short>(mb, sport, dport)),
@@ -201,13 +477,44 @@ config::config(metabase& mb) :
 	request_max_delay(ddely),
 	rcpt_append(message_append(rcpt_response_)),
 	rcpt_response(rcpt_response_.c_str()),
-	rcpt_status(dfsts)
+	rcpt_status(dfsts),
+	rate_limit(drate),
+	rate_burst(dbrst),
+	temp_response(temp_response_.c_str()),
+	temp_status(dtsts),
+	harvest_session(dhses),
+	harvest_client(dhcli),
+	harvest_window(dhwnd),
+	harvest_blacklist(dhbls),
+	cache_ttl(dctim),
+	cache_file(cache_file_.c_str()),
+	cache_size(dcsiz),
+	cache_stale(dcstl),
+	cache_grace(dcgrc),
+	connections(dconn),
+	fold_local(dfold),
+	stats_interval(dstin),
+	stats_file(stats_file_.c_str()),
+	exclusion_file(exclusion_file_.c_str()),
+	foreign_deny(dfpol),
+	directory_file(directory_file_.c_str()),
+	learn_threshold(dltrh),
+	learn_ttl(dltll),
+	learn_probe(dlprb),
+	verify_vrfy(dvrfy),
+	pipeline_depth(dppln)
 {}
 
 config::config(metabase& mb, const complete_t&) :
 	protocol_helo_(read<std::string>(mb, shelo, dhelo)),
 	protocol_from_(read<std::string>(mb, sfrom, dfrom)),
 	rcpt_response_(read<std::string>(mb, sfrcp, dfrcp)),
+	temp_response_(read<std::string>(mb, stmsg, dtmsg)),
+	cache_file_(read<std::string>(mb, scfil, dcfil)),
+	subaddress_(read<std::string>(mb, ssubs, dsubs)),
+	stats_file_(read<std::string>(mb, sstfl, dstfl)),
+	exclusion_file_(read<std::string>(mb, sexfl, dexfl)),
+	directory_file_(read<std::string>(mb, sdirf, ddirf)),
 	refresh(read<bool>(mb, srefr, false)),
 	server_address(tcp::ip4_addr(read<std::string>(mb, saddr).c_str())),
 	server_port(read<unsigned short>(mb, sport, dport)),
@@ -219,9 +526,37 @@ config::config(metabase& mb, const complete_t&) :
 	request_max_delay(read<unsigned int>(mb, sdely, ddely)),
 	rcpt_append(message_append(rcpt_response_)),
 	rcpt_response(rcpt_response_.c_str()),
-	rcpt_status(read<unsigned int>(mb, sfsts, dfsts))
+	rcpt_status(read<unsigned int>(mb, sfsts, dfsts)),
+	rate_limit(read<unsigned int>(mb, srate, drate)),
+	rate_burst(read<unsigned int>(mb, sbrst, dbrst)),
+	temp_response(temp_response_.c_str()),
+	temp_status(read<unsigned int>(mb, ststs, dtsts)),
+	harvest_session(read<unsigned int>(mb, shses, dhses)),
+	harvest_client(read<unsigned int>(mb, shcli, dhcli)),
+	harvest_window(read<unsigned int>(mb, shwnd, dhwnd)),
+	harvest_blacklist(read<unsigned int>(mb, shbls, dhbls)),
+	cache_ttl(read<unsigned int>(mb, sctim, dctim)),
+	cache_file(cache_file_.c_str()),
+	cache_size(read<unsigned int>(mb, scsiz, dcsiz)),
+	cache_stale(read<unsigned int>(mb, scstl, dcstl)),
+	cache_grace(read<unsigned int>(mb, scgrc, dcgrc)),
+	connections(read<unsigned int>(mb, sconn, dconn)),
+	fold_local(read<bool>(mb, sfold, dfold)),
+	stats_interval(read<unsigned int>(mb, sstin, dstin)),
+	stats_file(stats_file_.c_str()),
+	exclusion_file(exclusion_file_.c_str()),
+	foreign_deny(read<bool>(mb, sfpol, dfpol)),
+	directory_file(directory_file_.c_str()),
+	learn_threshold(read<unsigned int>(mb, sltrh, dltrh)),
+	learn_ttl(read<unsigned int>(mb, sltll, dltll)),
+	learn_probe(read<bool>(mb, slprb, dlprb)),
+	verify_vrfy(read<bool>(mb, svrfy, dvrfy)),
+	pipeline_depth(read<unsigned int>(mb, sppln, dppln))
 {
 	read_exclusions(mb);
+	read_aliases(mb);
+	read_domains(mb);
+	read_policies(mb);
 
 	unsigned char buf[sizeof(DWORD)] = {0};
 	METADATA_RECORD record = {srefr, 0, 0, DWORD_METADATA, sizeof(buf), buf, 0};
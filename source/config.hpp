@@ -14,11 +14,40 @@ private:
 	std::string						protocol_helo_;
 	std::string						protocol_from_;
 	std::string						rcpt_response_;
+	std::string						temp_response_;
+	std::string						cache_file_;
+	std::string						subaddress_;
+	std::string						stats_file_;
+	std::string						exclusion_file_;
+	std::string						directory_file_;
 
 	std::vector<unsigned long>		exclusions_;
 	mutable win32::critical_section	exc_lock_;
 
+	typedef std::vector<std::pair<std::string, std::string> > alias_map;
+	alias_map						aliases_;	// sorted on alias
+
+	std::vector<std::string>		domains_;	// sorted, matching only itself
+	std::vector<std::string>		suffixes_;	// sorted, matching subdomains too
+
+public:
+	// what to do with recipients in given domain, see learned_policy
+	enum policy
+	{
+		policy_learn,	// learn domain behavior, if enabled
+		policy_accept,
+		policy_reject,
+		policy_verify	// always ask internal server
+	};
+
+private:
+	typedef std::vector<std::pair<std::string, policy> > policy_map;
+	policy_map						policies_;	// sorted on domain
+
 	void read_exclusions(metabase& md);
+	void read_aliases(metabase& md);
+	void read_domains(metabase& md);
+	void read_policies(metabase& md);
 
 public:
 	struct error : public std::runtime_error
@@ -43,6 +72,34 @@ public:
 	const bool						rcpt_append;
 	const char* const				rcpt_response;
 	unsigned int const				rcpt_status;
+	const unsigned int				rate_limit;
+	const unsigned int				rate_burst;
+	const char* const				temp_response;
+	const unsigned int				temp_status;
+	const unsigned int				harvest_session;
+	const unsigned int				harvest_client;
+	const unsigned int				harvest_window;
+	const unsigned int				harvest_blacklist;
+	const unsigned int				cache_ttl;
+	const char* const				cache_file;
+	const unsigned int				cache_size;
+	const unsigned int				cache_stale;
+	const unsigned int				cache_grace;
+	const unsigned int				connections;
+	const bool						fold_local;
+	const unsigned int				stats_interval;
+	const char* const				stats_file;
+	const char* const				exclusion_file;
+	const bool						foreign_deny;
+	const char* const				directory_file;
+	const unsigned int				learn_threshold;
+	const unsigned int				learn_ttl;
+	const bool						learn_probe;
+	const bool						verify_vrfy;
+	const unsigned int				pipeline_depth;
+
+	// both constructors read values found by last metabase::load, thus
+	// limited and complete configuration may share single round trip
 
 	// read limited configuration - IP, port and refresh req
 	explicit config(metabase& mb);
@@ -54,7 +111,17 @@ public:
 		protocol_helo_(other.protocol_helo_),
 		protocol_from_(other.protocol_from_),
 		rcpt_response_(other.rcpt_response_),
+		temp_response_(other.temp_response_),
+		cache_file_(other.cache_file_),
+		subaddress_(other.subaddress_),
+		stats_file_(other.stats_file_),
+		exclusion_file_(other.exclusion_file_),
+		directory_file_(other.directory_file_),
 		exclusions_(other.exclusions_),
+		aliases_(other.aliases_),
+		domains_(other.domains_),
+		suffixes_(other.suffixes_),
+		policies_(other.policies_),
 		refresh(other.refresh),
 		server_address(other.server_address),
 		server_port(other.server_port),
@@ -66,9 +133,45 @@ public:
 		request_max_delay(other.request_max_delay),
 		rcpt_append(other.rcpt_append),
 		rcpt_response(rcpt_response_.c_str()),
-		rcpt_status(other.rcpt_status)
+		rcpt_status(other.rcpt_status),
+		rate_limit(other.rate_limit),
+		rate_burst(other.rate_burst),
+		temp_response(temp_response_.c_str()),
+		temp_status(other.temp_status),
+		harvest_session(other.harvest_session),
+		harvest_client(other.harvest_client),
+		harvest_window(other.harvest_window),
+		harvest_blacklist(other.harvest_blacklist),
+		cache_ttl(other.cache_ttl),
+		cache_file(cache_file_.c_str()),
+		cache_size(other.cache_size),
+		cache_stale(other.cache_stale),
+		cache_grace(other.cache_grace),
+		connections(other.connections),
+		fold_local(other.fold_local),
+		stats_interval(other.stats_interval),
+		stats_file(stats_file_.c_str()),
+		exclusion_file(exclusion_file_.c_str()),
+		foreign_deny(other.foreign_deny),
+		directory_file(directory_file_.c_str()),
+		learn_threshold(other.learn_threshold),
+		learn_ttl(other.learn_ttl),
+		learn_probe(other.learn_probe),
+		verify_vrfy(other.verify_vrfy),
+		pipeline_depth(other.pipeline_depth)
 	{}
 
+	// canonical form of recipient address, used to verify it and as key in
+	// cache: domain aliases resolved, subaddress removed, case folded
+	std::string canonical(const std::string& rcpt) const;
+
+	// true if domain of canonical recipient is hosted by internal server,
+	// or if list of hosted domains is empty (i.e. prefilter is disabled)
+	bool is_hosted(const std::string& canonical) const;
+
+	// policy for domain set by administrator, policy_learn if not set
+	policy learned_policy(const char* domain) const;
+
 	bool is_excluded(unsigned long client_ip) const
 	{
 		const sync::scoped_lock& g = sync::acquire(exc_lock_);
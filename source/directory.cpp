@@ -0,0 +1,392 @@
+// directory.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "directory.hpp"
+#include "address.hpp"
+#include "util.hpp"
+
+namespace
+{
+
+const unsigned long magic = 0x44504352; // "RCPD"
+const unsigned long keys_per_bucket = 4;
+const unsigned long max_displacement = 0x7FFFFFFFUL;
+const unsigned int max_message = 500;
+
+// displacement with this bit set is slot of single mailbox in its bucket
+const unsigned long direct = 0x80000000UL;
+
+struct header
+{
+	unsigned long		magic;
+	unsigned long		version;
+	unsigned long		count;		// mailboxes, i.e. slots in table
+	unsigned long		buckets;	// entries in displacement table
+	unsigned long		domains;	// size of domain list, in bytes
+	unsigned long		reserved;
+};
+
+// layout of file: header, displacement table, table of hashes (aligned
+// to 8 bytes) and domain names, each one terminated with zero
+size_t hashes_offset(unsigned long buckets)
+{
+	return (sizeof(header) + buckets * sizeof(unsigned long) + 7) & ~static_cast<size_t> (7);
+}
+
+// finalizer of MurmurHash3, spreads all bits of FNV-1a hash of mailbox
+inline unsigned __int64 mix(unsigned __int64 h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+inline unsigned long bucket(unsigned __int64 h, unsigned long buckets)
+{
+	return static_cast<unsigned long> (mix(h) % buckets);
+}
+
+inline unsigned long slot(unsigned __int64 h, unsigned long displacement, unsigned long count)
+{
+	return static_cast<unsigned long> (mix(h ^ ((displacement + 1) * 0x9E3779B97F4A7C15ULL)) % count);
+}
+
+inline bool blank(char ch)
+{
+	return static_cast<unsigned char> (ch) <= ' ';
+}
+
+void write(HANDLE file, const void* data, size_t size)
+{
+	DWORD written = 0;
+	if (size != 0 && (!WriteFile(file, data, static_cast<DWORD> (size), &written, NULL) || written != size))
+		throw directory::error("Unable to write directory file");
+}
+
+} // unnamed namespace
+
+directory::image::image(const char* file) :
+	view_(NULL),
+	count_(0),
+	buckets_(0),
+	displacement_(NULL),
+	hashes_(NULL)
+{
+	// renaming file will not disturb us, see build
+	const HANDLE h = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		throw error("Unable to open directory file");
+	win32::handle f(h);
+
+	const DWORD size = GetFileSize(*f, NULL);
+	if (size == INVALID_FILE_SIZE || size < sizeof(header))
+		throw error("Invalid directory file");
+
+	mapping_ = CreateFileMappingA(*f, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (*mapping_ == NULL)
+		throw error("Unable to create directory file mapping");
+
+	view_ = MapViewOfFile(*mapping_, FILE_MAP_READ, 0, 0, 0);
+	if (view_ == NULL)
+		throw error("Unable to map directory file");
+
+	const header& hd = *static_cast<const header*> (view_);
+	if (hd.magic != magic || hd.version != version || hd.buckets == 0
+		|| hd.buckets > size / sizeof(unsigned long) || hd.count > size / sizeof(unsigned __int64) || hd.domains > size)
+	{
+		UnmapViewOfFile(view_);
+		throw error("Invalid directory file");
+	}
+
+	const size_t hashes = hashes_offset(hd.buckets);
+	const size_t domains = hashes + static_cast<size_t> (hd.count) * sizeof(unsigned __int64);
+	if (domains + hd.domains != size)
+	{
+		UnmapViewOfFile(view_);
+		throw error("Invalid directory file");
+	}
+
+	const char* const base = static_cast<const char*> (view_);
+	count_ = hd.count;
+	buckets_ = hd.buckets;
+	displacement_ = reinterpret_cast<const unsigned long*> (base + sizeof(header));
+	hashes_ = reinterpret_cast<const unsigned __int64*> (base + hashes);
+
+	// list of domains is short, keep it in memory
+	const char* p = base + domains;
+	const char* const end = p + hd.domains;
+	while (p != end)
+	{
+		const char* const e = static_cast<const char*> (memchr(p, '\0', end - p));
+		if (e == NULL)
+			break;
+		domains_.push_back(std::string(p, e));
+		p = e + 1;
+	}
+	std::sort(domains_.begin(), domains_.end());
+}
+
+directory::image::~image()
+{
+	UnmapViewOfFile(view_);
+}
+
+bool directory::image::hosts(const char* domain) const
+{
+	return std::binary_search(domains_.begin(), domains_.end(), std::string(domain));
+}
+
+bool directory::image::find(unsigned __int64 hash) const
+{
+	if (count_ == 0)
+		return false;
+
+	const unsigned long d = displacement_[bucket(hash, buckets_)];
+	const unsigned long s = (d & direct) != 0 ? (d & ~direct) : slot(hash, d, count_);
+	return s < count_ && hashes_[s] == hash;
+}
+
+directory::directory() :
+	lock_(spin_),
+	checked_(static_cast<LONG> (GetTickCount() - check_interval))
+{
+	memset(&stamp_, 0, sizeof(stamp_));
+}
+
+void directory::check(const char* file)
+{
+	// only one thread will check, others will keep using old version
+	const LONG last = checked_;
+	const DWORD now = GetTickCount();
+	if (now - static_cast<DWORD> (last) < check_interval)
+		return;
+	if (InterlockedCompareExchange(&checked_, static_cast<LONG> (now), last) != last)
+		return;
+
+	WIN32_FILE_ATTRIBUTE_DATA stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	if (*file != '\0' && !GetFileAttributesExA(file, GetFileExInfoStandard, &stamp))
+		return; // file is being replaced
+
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		if (file_ == file && CompareFileTime(&stamp_.ftLastWriteTime, &stamp.ftLastWriteTime) == 0
+			&& stamp_.nFileSizeLow == stamp.nFileSizeLow && stamp_.nFileSizeHigh == stamp.nFileSizeHigh)
+			return;
+	} // free lock_
+
+	sync::shared<image> i;
+	if (*file != '\0')
+	{
+		try
+		{
+			i = sync::shared<image>(new image(file));
+		}
+		catch (const error& e)
+		{
+			char message[max_message] = {0};
+			if (str::format(std::nothrow, message, "Exception in %s, directory::error : %s\n", __FUNCTION__, e.what()))
+				OutputDebugStringA(message);
+			return;
+		}
+	}
+
+	const sync::scoped_lock& g = sync::acquire(lock_);
+	image_.swap(i);
+	file_ = file;
+	stamp_ = stamp;
+} // old version is unmapped here, unless some thread is still using it
+
+bool directory::verify(const config&, const std::string& rcpt, bool& allow)
+{
+	sync::shared<image> i;
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		i = image_;
+	} // free lock_
+
+	const size_t at = rcpt.rfind('@');
+	if (i.get() == NULL || at == std::string::npos || !i->hosts(rcpt.c_str() + at + 1))
+		return false;
+
+	allow = i->find(str::hash(rcpt));
+	return true;
+}
+
+unsigned long directory::build(const char* source, const char* target, bool fold_local)
+{
+	std::vector<char> data;
+	{
+		const HANDLE h = CreateFileA(source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (h == INVALID_HANDLE_VALUE)
+			throw error("Unable to open list of mailboxes");
+		win32::handle f(h);
+
+		const DWORD size = GetFileSize(*f, NULL);
+		if (size == INVALID_FILE_SIZE)
+			throw error("Unable to read list of mailboxes");
+
+		data.resize(size);
+		DWORD read = 0;
+		if (size != 0 && (!ReadFile(*f, &data[0], size, &read, NULL) || read != size))
+			throw error("Unable to read list of mailboxes");
+	}
+
+	// mailboxes are stored in canonical form, see config::canonical
+	std::vector<unsigned __int64> keys;
+	std::set<std::string> domains;
+	const char* p = data.empty() ? NULL : &data[0];
+	const char* const end = p + data.size();
+	while (p != end)
+	{
+		const char* eol = static_cast<const char*> (memchr(p, '\n', end - p));
+		if (eol == NULL)
+			eol = end;
+
+		const char* first = p;
+		const char* last = eol;
+		p = (eol == end ? eol : eol + 1);
+
+		while (first != last && blank(*first))
+			++first;
+		while (last != first && blank(*(last - 1)))
+			--last;
+		if (first == last || *first == '#')
+			continue;
+
+		std::string mailbox(first, last);
+		const size_t at = mailbox.rfind('@');
+		if (at == std::string::npos || at == 0 || at + 1 == mailbox.size())
+			continue;
+
+		address::lower(&mailbox[0] + at + 1, mailbox.size() - at - 1);
+		if (fold_local)
+			address::lower(&mailbox[0], at);
+
+		keys.push_back(str::hash(mailbox));
+		domains.insert(mailbox.substr(at + 1));
+	}
+
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	if (keys.size() >= direct)
+		throw error("Too many mailboxes");
+
+	const unsigned long count = static_cast<unsigned long> (keys.size());
+	const unsigned long buckets = std::max(1UL, (count + keys_per_bucket - 1) / keys_per_bucket);
+
+	// group keys in buckets, and place largest buckets first
+	std::vector<unsigned long> first(buckets + 1, 0);
+	for (unsigned long i = 0; i < count; ++i)
+		++first[bucket(keys[i], buckets) + 1];
+	for (unsigned long b = 0; b < buckets; ++b)
+		first[b + 1] += first[b];
+
+	std::vector<unsigned __int64> grouped(count);
+	{
+		std::vector<unsigned long> next(first.begin(), first.end() - 1);
+		for (unsigned long i = 0; i < count; ++i)
+			grouped[next[bucket(keys[i], buckets)]++] = keys[i];
+	}
+
+	std::vector<std::pair<unsigned long, unsigned long> > order(buckets);
+	for (unsigned long b = 0; b < buckets; ++b)
+		order[b] = std::make_pair(first[b + 1] - first[b], b);
+	std::sort(order.begin(), order.end(), std::greater<std::pair<unsigned long, unsigned long> >());
+
+	std::vector<unsigned long> displacement(buckets, 0);
+	std::vector<unsigned __int64> table(count, 0);
+	std::vector<bool> taken(count, false);
+	std::vector<unsigned long> slots;
+	unsigned long next_free = 0;
+	for (unsigned long o = 0; o < buckets && order[o].first != 0; ++o)
+	{
+		const unsigned long b = order[o].second;
+		const unsigned __int64* const k = &grouped[first[b]];
+		const unsigned long size = order[o].first;
+
+		// single mailbox takes any free slot
+		if (size == 1)
+		{
+			while (taken[next_free])
+				++next_free;
+			displacement[b] = direct | next_free;
+			taken[next_free] = true;
+			table[next_free] = k[0];
+			continue;
+		}
+
+		for (unsigned long d = 0; ; ++d)
+		{
+			if (d == max_displacement)
+				throw error("Unable to build perfect hash of mailboxes");
+
+			slots.clear();
+			for (unsigned long i = 0; i < size; ++i)
+			{
+				const unsigned long s = slot(k[i], d, count);
+				if (taken[s] || std::find(slots.begin(), slots.end(), s) != slots.end())
+					break;
+				slots.push_back(s);
+			}
+
+			if (slots.size() != size)
+				continue;
+
+			displacement[b] = d;
+			for (unsigned long i = 0; i < size; ++i)
+			{
+				taken[slots[i]] = true;
+				table[slots[i]] = k[i];
+			}
+			break;
+		}
+	}
+
+	std::string names;
+	for (std::set<std::string>::const_iterator i = domains.begin(); i != domains.end(); ++i)
+	{
+		names += *i;
+		names += '\0';
+	}
+
+	const header hd = {magic, version, count, buckets, static_cast<unsigned long> (names.size()), 0};
+	const char padding[8] = {0};
+
+	// sinks may still use old version, which can be renamed but not overwritten
+	const std::string fresh = std::string(target) + ".new";
+	const std::string old = std::string(target) + ".old";
+	{
+		const HANDLE h = CreateFileA(fresh.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (h == INVALID_HANDLE_VALUE)
+			throw error("Unable to create directory file");
+		win32::handle f(h);
+
+		write(*f, &hd, sizeof(hd));
+		write(*f, &displacement[0], buckets * sizeof(unsigned long));
+		write(*f, padding, hashes_offset(buckets) - sizeof(hd) - buckets * sizeof(unsigned long));
+		if (count != 0)
+			write(*f, &table[0], count * sizeof(unsigned __int64));
+		write(*f, names.data(), names.size());
+		if (!FlushFileBuffers(*f))
+			throw error("Unable to write directory file");
+	}
+
+	if (GetFileAttributesA(target) != INVALID_FILE_ATTRIBUTES
+		&& !MoveFileExA(target, old.c_str(), MOVEFILE_REPLACE_EXISTING))
+		throw error("Unable to rename previous directory file, it might be still in use");
+
+	if (!MoveFileExA(fresh.c_str(), target, MOVEFILE_REPLACE_EXISTING))
+		throw error("Unable to rename new directory file");
+
+	return count;
+}
@@ -0,0 +1,85 @@
+// directory.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util_ptr.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+struct config;
+
+// Directory of valid mailboxes, exported from internal server and built
+// offline (see build) into file which is memory mapped. File holds list of
+// domains, and minimal perfect hash table of 64-bit hashes of mailboxes:
+// mailbox is found in one probe, and directory takes 9 bytes per mailbox
+// (8 for hash, 1 on average for displacement table). Recipient in domain
+// listed in directory is allowed only if it is found in the table; other
+// recipients are left for cache and internal server.
+// File is checked for changes at most once per check_interval, and new
+// version is mapped and swapped in just like exclusion table.
+class directory
+{
+public:
+	struct error : public std::runtime_error
+	{
+		explicit error(const char* msg) : std::runtime_error(msg) {}
+	};
+
+	// update when layout or meaning of file changes
+	static const unsigned long version = 1;
+	static const DWORD check_interval = 1000;	// milliseconds
+
+private:
+	// non-copyable and non-assignable
+	directory(const directory&);
+	directory& operator=(const directory&);
+
+	static const unsigned int spin_ = 4000;
+
+	// mapped file, read-only
+	class image
+	{
+		image(const image&);
+		image& operator=(const image&);
+
+		win32::handle					mapping_;
+		const void*						view_;
+		unsigned long					count_;
+		unsigned long					buckets_;
+		const unsigned long*			displacement_;
+		const unsigned __int64*			hashes_;
+		std::vector<std::string>		domains_;	// sorted
+
+	public:
+		explicit image(const char* file);
+		~image();
+
+		bool hosts(const char* domain) const;
+		bool find(unsigned __int64 hash) const;
+	};
+
+	mutable win32::critical_section	lock_;		// guards all below
+	sync::shared<image>				image_;
+	std::string						file_;
+	WIN32_FILE_ATTRIBUTE_DATA		stamp_;
+	volatile LONG					checked_;	// GetTickCount() of last check
+
+public:
+	directory();
+
+	// map new version of file if file name or file itself has changed since
+	// last check. Empty name disables directory. If file cannot be mapped
+	// (e.g. it is being replaced), old version is kept
+	void check(const char* file);
+
+	bool verify(const config& c, const std::string& rcpt, bool& allow);
+
+	// build directory file from text file with one mailbox per line. New
+	// file is written next to target and renamed, so that sinks using old
+	// version never see partially written file. Returns number of mailboxes
+	static unsigned long build(const char* source, const char* target, bool fold_local);
+};
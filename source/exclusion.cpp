@@ -0,0 +1,345 @@
+// exclusion.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "exclusion.hpp"
+#include "socket.hpp"
+#include "util.hpp"
+
+namespace
+{
+
+const unsigned int max_line = 64;
+const unsigned int max_message = 500;
+
+inline bool blank(char ch)
+{
+	return static_cast<unsigned char> (ch) <= ' ';
+}
+
+// parse "a.b.c.d" or "a.b.c.d/n" into range of addresses in host byte order
+bool parse_line(const char* sz, unsigned long& first, unsigned long& last)
+{
+	unsigned long ip = 0;
+	const char* p = tcp::detail::ip4_parse(sz, ip);
+	if (p == NULL)
+		return false;
+
+	unsigned int bits = 32;
+	if (*p == '/')
+	{
+		++p;
+		unsigned int digits = 0;
+		for (bits = 0; digits < 2 && *p >= '0' && *p <= '9'; ++p, ++digits)
+			bits = bits * 10 + (*p - '0');
+		if (digits == 0 || bits > 32)
+			return false;
+	}
+
+	if (*p != '\0')
+		return false;
+
+	const unsigned long mask = bits == 0 ? 0 : 0xFFFFFFFFUL << (32 - bits);
+	first = ntohl(ip) & mask;
+	last = first | ~mask;
+	return true;
+}
+
+// time of last access is ignored, as it is changed by reading the file
+inline bool same(const WIN32_FILE_ATTRIBUTE_DATA& lh, const WIN32_FILE_ATTRIBUTE_DATA& rh)
+{
+	return lh.nFileSizeLow == rh.nFileSizeLow && lh.nFileSizeHigh == rh.nFileSizeHigh
+		&& CompareFileTime(&lh.ftLastWriteTime, &rh.ftLastWriteTime) == 0;
+}
+
+} // unnamed namespace
+
+exclusion::exclusion() :
+	lock_(spin_),
+	next_exists_(false),
+	checked_(static_cast<LONG> (GetTickCount() - check_interval)),
+	loading_(0)
+{
+	memset(&stamp_, 0, sizeof(stamp_));
+	memset(&next_stamp_, 0, sizeof(next_stamp_));
+}
+
+exclusion::~exclusion()
+{
+	if (*thread_ != NULL)
+		WaitForSingleObject(*thread_, INFINITE);
+}
+
+void exclusion::parse(chunk& c)
+{
+	c.invalid = 0;
+	const char* p = c.begin;
+	while (p != c.end)
+	{
+		const char* eol = static_cast<const char*> (memchr(p, '\n', c.end - p));
+		if (eol == NULL)
+			eol = c.end;
+
+		const char* first = p;
+		const char* last = eol;
+		p = (eol == c.end ? eol : eol + 1);
+
+		while (first != last && blank(*first))
+			++first;
+		while (last != first && blank(*(last - 1)))
+			--last;
+		if (first == last || *first == '#')
+			continue;
+
+		char line[max_line];
+		range r;
+		if (static_cast<size_t> (last - first) >= sizeof(line))
+		{
+			++c.invalid;
+			continue;
+		}
+
+		memcpy(line, first, last - first);
+		line[last - first] = '\0';
+		if (parse_line(line, r.first, r.last))
+			c.ranges.push_back(r);
+		else
+			++c.invalid;
+	}
+}
+
+DWORD WINAPI exclusion::parse_thread(void* pv)
+{
+	try
+	{
+		parse(*static_cast<chunk*> (pv));
+	}
+	catch (const std::exception&)
+	{
+		// out of memory. Caller will find out
+		static_cast<chunk*> (pv)->invalid = ~0U;
+	}
+	return 0;
+}
+
+sync::shared<exclusion::table> exclusion::load(const char* file)
+{
+	const HANDLE h = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return sync::shared<table>();
+	win32::handle f(h);
+
+	const DWORD size = GetFileSize(h, NULL);
+	if (size == INVALID_FILE_SIZE)
+		return sync::shared<table>();
+
+	std::vector<char> data(size);
+	DWORD read = 0;
+	if (size != 0 && (!ReadFile(h, &data[0], size, &read, NULL) || read != size))
+		return sync::shared<table>();
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	unsigned int count = std::min<unsigned int> (max_threads, si.dwNumberOfProcessors);
+	count = std::max<unsigned int> (1, std::min<unsigned int> (count, size / min_chunk));
+
+	// chunks are split on line boundaries
+	const char* const begin = size != 0 ? &data[0] : NULL;
+	const char* const end = begin + size;
+	std::vector<chunk> chunks(count);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		chunks[i].begin = (i == 0 ? begin : chunks[i - 1].end);
+		const char* e = begin + (static_cast<unsigned __int64> (size) * (i + 1)) / count;
+		if (e < chunks[i].begin)
+			e = chunks[i].begin;
+		while (e != end && *(e - 1) != '\n')
+			++e;
+		chunks[i].end = e;
+		chunks[i].invalid = 0;
+	}
+
+	// first chunk is parsed by this thread, or all of them if no thread can be started
+	std::vector<HANDLE> threads;
+	for (unsigned int i = 1; i < count; ++i)
+	{
+		DWORD id = 0;
+		const HANDLE t = CreateThread(NULL, 0, &parse_thread, &chunks[i], 0, &id);
+		if (t == NULL)
+		{
+			for (; i < count; ++i)
+				parse_thread(&chunks[i]);
+			break;
+		}
+		threads.push_back(t);
+	}
+
+	parse_thread(&chunks[0]);
+	if (!threads.empty())
+	{
+		WaitForMultipleObjects(static_cast<DWORD> (threads.size()), &threads[0], TRUE, INFINITE);
+		for (size_t i = 0; i < threads.size(); ++i)
+			CloseHandle(threads[i]);
+	}
+
+	size_t total = 0;
+	unsigned int invalid = 0;
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		if (chunks[i].invalid == ~0U)
+			return sync::shared<table>();
+		total += chunks[i].ranges.size();
+		invalid += chunks[i].invalid;
+	}
+
+	table all;
+	all.reserve(total);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		all.insert(all.end(), chunks[i].ranges.begin(), chunks[i].ranges.end());
+		table().swap(chunks[i].ranges);
+	}
+
+	// merge overlapping and adjacent ranges
+	std::sort(all.begin(), all.end());
+	sync::shared<table> result(new table);
+	result->reserve(all.size());
+	for (table::const_iterator i = all.begin(); i != all.end(); ++i)
+	{
+		if (!result->empty() && (result->back().last == 0xFFFFFFFFUL || i->first <= result->back().last + 1))
+		{
+			if (i->last > result->back().last)
+				result->back().last = i->last;
+		}
+		else
+			result->push_back(*i);
+	}
+
+	if (invalid != 0)
+	{
+		char message[max_message] = {0};
+		if (str::format(std::nothrow, message, "Skipped %u invalid lines in exclusion file %s\n", invalid, file))
+			OutputDebugStringA(message);
+	}
+
+	return result;
+}
+
+void exclusion::check(const char* file)
+{
+	// only one thread will check, others will keep using old table
+	const LONG last = checked_;
+	const DWORD now = GetTickCount();
+	if (now - static_cast<DWORD> (last) < check_interval)
+		return;
+	if (InterlockedCompareExchange(&checked_, static_cast<LONG> (now), last) != last)
+		return;
+
+	WIN32_FILE_ATTRIBUTE_DATA stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	const bool exists = *file != '\0' && GetFileAttributesExA(file, GetFileExInfoStandard, &stamp) != FALSE;
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		if (file_ == file && same(stamp_, stamp))
+			return;
+	} // free lock_
+
+	// one load at a time. Change noticed meanwhile is loaded after next check
+	if (InterlockedCompareExchange(&loading_, 1, 0) != 0)
+		return;
+
+	try
+	{
+		{
+			const sync::scoped_lock& g = sync::acquire(lock_);
+			next_file_ = file;
+			next_stamp_ = stamp;
+			next_exists_ = exists;
+		} // free lock_
+
+		// previous thread has finished, since it reset loading_
+		if (*thread_ != NULL)
+			WaitForSingleObject(*thread_, INFINITE);
+		DWORD id = 0;
+		thread_ = CreateThread(NULL, 0, &load_thread, this, 0, &id);
+	}
+	catch (const std::exception&)
+	{
+		thread_ = NULL;
+	}
+
+	// will try again after next check
+	if (*thread_ == NULL)
+		InterlockedExchange(&loading_, 0);
+}
+
+DWORD WINAPI exclusion::load_thread(void* pv)
+{
+	exclusion* const e = static_cast<exclusion*> (pv);
+	try
+	{
+		e->reload();
+	}
+	catch (const std::exception& ex)
+	{
+		// old table is kept
+		char message[max_message];
+		if (str::format(std::nothrow, message, "Exception in %s, %s : %s\n", __FUNCTION__, typeid(ex).name(), ex.what()))
+			OutputDebugStringA(message);
+	}
+
+	InterlockedExchange(&e->loading_, 0);
+	return 0;
+}
+
+void exclusion::reload()
+{
+	std::string file;
+	WIN32_FILE_ATTRIBUTE_DATA stamp;
+	bool exists = false;
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		file = next_file_;
+		stamp = next_stamp_;
+		exists = next_exists_;
+	} // free lock_
+
+	sync::shared<table> t;
+	if (exists)
+	{
+		t = load(file.c_str());
+		if (t.get() == NULL)
+			return;
+	}
+
+	const sync::scoped_lock& g = sync::acquire(lock_);
+	table_.swap(t);
+	file_ = file;
+	stamp_ = stamp;
+} // old table is released here, unless some thread is still using it
+
+bool exclusion::find(unsigned long ip) const
+{
+	sync::shared<table> t;
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		t = table_;
+	} // free lock_
+
+	if (t.get() == NULL || t->empty())
+		return false;
+
+	range r;
+	r.first = ntohl(ip);
+	table::const_iterator i = std::upper_bound(t->begin(), t->end(), r);
+	if (i == t->begin())
+		return false;
+
+	--i;
+	return r.first <= i->last;
+}
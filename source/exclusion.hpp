@@ -0,0 +1,89 @@
+// exclusion.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util_ptr.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Exclusion list read from text file, for lists too long to be kept in
+// metabase. Each line holds IPv4 address or prefix "a.b.c.d/n"; blank
+// lines and lines starting with '#' are skipped. Large file is split into
+// chunks parsed by separate threads, and all entries are merged into
+// sorted table of disjoint ranges, searched with binary search. File is
+// checked for changes at most once per check_interval; changed file is
+// loaded by background thread, which builds new table without any lock
+// held and swaps it in with single pointer assignment. Lookups keep using
+// old table until then.
+class exclusion
+{
+public:
+	static const unsigned int max_threads = 8;
+	static const unsigned int min_chunk = 65536;	// bytes parsed by one thread
+	static const DWORD check_interval = 1000;		// milliseconds
+
+private:
+	// non-copyable and non-assignable
+	exclusion(const exclusion&);
+	exclusion& operator=(const exclusion&);
+
+	static const unsigned int spin_ = 4000;
+
+	// addresses in host byte order, both ends included
+	struct range
+	{
+		unsigned long				first;
+		unsigned long				last;
+
+		friend bool operator< (const range& lh, const range& rh)
+		{
+			return lh.first < rh.first;
+		}
+	};
+
+	typedef std::vector<range> table;
+
+	struct chunk
+	{
+		const char*					begin;
+		const char*					end;
+		table						ranges;
+		unsigned int				invalid;	// count of lines skipped
+	};
+
+	mutable win32::critical_section	lock_;		// guards all below
+	sync::shared<table>				table_;
+	std::string						file_;
+	WIN32_FILE_ATTRIBUTE_DATA		stamp_;
+	std::string						next_file_;	// to be loaded by thread_
+	WIN32_FILE_ATTRIBUTE_DATA		next_stamp_;
+	bool							next_exists_;
+	volatile LONG					checked_;	// GetTickCount() of last check
+	volatile LONG					loading_;	// 1 while thread_ is running
+	win32::handle					thread_;
+
+	static DWORD WINAPI load_thread(void* pv);
+	static DWORD WINAPI parse_thread(void* pv);
+	static void parse(chunk& c);
+	static sync::shared<table> load(const char* file);
+	void reload();
+
+public:
+	exclusion();
+
+	// wait for loading thread to finish
+	~exclusion();
+
+	// start (re)loading table if file name or file itself (its size or
+	// time of last write) has changed since last check. Empty name or
+	// missing file means empty table. If file cannot be read, old table is
+	// kept. Does not wait for table to be loaded
+	void check(const char* file);
+
+	// true if client address (in network byte order) is in the table
+	bool find(unsigned long ip) const;
+};
@@ -0,0 +1,169 @@
+// harvest.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "harvest.hpp"
+
+namespace
+{
+
+// one seed per row of sketch
+const unsigned long seeds[harvest::depth] = {0x8F1BBCDCUL, 0xCA62C1D6UL, 0x5A827999UL, 0x6ED9EBA1UL};
+
+} // unnamed namespace
+
+harvest::harvest() :
+	epoch_(static_cast<LONG> (GetTickCount())),
+	listed_(0)
+{
+	for (unsigned int i = 0; i < depth; ++i)
+		for (unsigned int j = 0; j < width; ++j)
+			sketch_[i][j] = 0;
+}
+
+unsigned long harvest::count(unsigned long key)
+{
+	// increment counter in every row and return the smallest one
+	LONG result = 0;
+	for (unsigned int i = 0; i < depth; ++i)
+	{
+		LONG c = InterlockedIncrement(&sketch_[i][hash(key ^ seeds[i]) % width]);
+		if (i == 0 || c < result)
+			result = c;
+	}
+
+	return static_cast<unsigned long> (result);
+}
+
+unsigned long harvest::count(const void* session, const void* message)
+{
+	const unsigned long h = hash(static_cast<unsigned long> (reinterpret_cast<ULONG_PTR> (session)));
+	shard& s = shards_[h % shards];
+	const unsigned int first = (h >> 4) % slots;
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	const DWORD now = GetTickCount();
+	session_entry* e = NULL;
+	for (unsigned int i = 0; i < probe; ++i)
+	{
+		session_entry& t = s.sessions[(first + i) % slots];
+		if (t.session == session || t.session == NULL)
+		{
+			e = &t;
+			break;
+		}
+
+		// take over entry of session which was idle for the longest time
+		if (e == NULL || now - t.updated > now - e->updated)
+			e = &t;
+	}
+
+	// count is kept for the whole session, also across RSET and MAIL FROM.
+	// Session object might be reused by IIS for next session, which will
+	// not start with message of the previous one, and not before the
+	// previous session timed out if it was idle
+	if (e->session != session || (e->message != message && now - e->updated > idle_))
+	{
+		e->session = session;
+		e->count = 0;
+	}
+
+	e->message = message;
+	e->updated = now;
+	return ++e->count;
+}
+
+void harvest::decay(DWORD window)
+{
+	const DWORD now = GetTickCount();
+	const LONG last = epoch_;
+	if (now - static_cast<DWORD> (last) < window)
+		return;
+
+	// only one thread will win, others will keep counting
+	if (InterlockedCompareExchange(&epoch_, static_cast<LONG> (now), last) != last)
+		return;
+
+	// increments racing with this loop might be lost. That's fine, it's just an estimate
+	for (unsigned int i = 0; i < depth; ++i)
+		for (unsigned int j = 0; j < width; ++j)
+			InterlockedExchange(&sketch_[i][j], sketch_[i][j] / 2);
+}
+
+void harvest::blacklist(unsigned long ip, DWORD duration)
+{
+	const unsigned long h = hash(ip);
+	shard& s = shards_[h % shards];
+	const unsigned int first = (h >> 4) % slots;
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	const DWORD now = GetTickCount();
+	entry* e = NULL;
+	for (unsigned int i = 0; i < probe; ++i)
+	{
+		entry& t = s.entries[(first + i) % slots];
+		if (t.ip == ip || t.ip == 0)
+		{
+			e = &t;
+			break;
+		}
+
+		// take over entry closest to expiration (or already expired)
+		if (e == NULL || static_cast<LONG> (t.expires - now) < static_cast<LONG> (e->expires - now))
+			e = &t;
+	}
+
+	if (e->ip == 0)
+		InterlockedIncrement(&listed_);
+	e->ip = ip;
+	e->expires = now + duration;
+}
+
+bool harvest::blacklisted(unsigned long ip)
+{
+	// no need to lock anything if there was no attack yet
+	if (listed_ == 0)
+		return false;
+
+	const unsigned long h = hash(ip);
+	shard& s = shards_[h % shards];
+	const unsigned int first = (h >> 4) % slots;
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	const DWORD now = GetTickCount();
+	for (unsigned int i = 0; i < probe; ++i)
+	{
+		const entry& e = s.entries[(first + i) % slots];
+		if (e.ip == ip)
+			return static_cast<LONG> (e.expires - now) > 0;
+		else if (e.ip == 0)
+			break;
+	}
+
+	return false;
+}
+
+bool harvest::denied(unsigned long ip, const void* session, const void* message, unsigned int session_threshold,
+	unsigned int client_threshold, unsigned int window, unsigned int duration)
+{
+	if (session_threshold == 0 && client_threshold == 0)
+		return false;
+
+	decay(1000UL * window);
+
+	if (client_threshold != 0 && count(ip) >= client_threshold)
+	{
+		blacklist(ip, 1000UL * duration);
+		return true;
+	}
+
+	// IIS does not give us any session identifier, but pointer to session object is unique while session lasts
+	if (session_threshold != 0 && session != NULL)
+		return count(session, message) >= session_threshold;
+
+	return false;
+}
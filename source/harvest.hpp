@@ -0,0 +1,91 @@
+// harvest.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Detection of directory harvest attacks. Recipients rejected by internal
+// SMTP server are counted per client IP in count-min sketch, that is fixed
+// size table of counters updated without locks. All counters are halved
+// once per window, thus estimate approximates number of rejected
+// recipients in recent window or two. Client which crossed the threshold
+// is put on blacklist, which has fixed size too. Recipients rejected in
+// SMTP session are counted exactly, in separate fixed size table, for the
+// whole session.
+class harvest
+{
+public:
+	static const unsigned int depth = 4;
+	static const unsigned int width = 2048;
+	static const unsigned int shards = 16;
+	static const unsigned int slots = 256;		// in each shard
+	static const unsigned int probe = 8;		// max. probing distance
+
+private:
+	// non-copyable and non-assignable
+	harvest(const harvest&);
+	harvest& operator=(const harvest&);
+
+	static const unsigned int spin_ = 4000;
+	static const DWORD idle_ = 600000;	// default idle timeout of IIS SMTP session
+
+	struct entry
+	{
+		unsigned long				ip;			// 0 means empty slot
+		DWORD						expires;	// GetTickCount() of expiration
+	};
+
+	struct session_entry
+	{
+		const void*					session;	// NULL means empty slot
+		const void*					message;	// last one, to detect reuse of session
+		unsigned long				count;
+		DWORD						updated;	// GetTickCount() of last count
+	};
+
+	struct shard
+	{
+		win32::critical_section		lock;
+		std::vector<entry>			entries;
+		std::vector<session_entry>	sessions;
+
+		shard() : lock(spin_), entries(slots), sessions(slots) {}
+	};
+
+	volatile LONG					sketch_[depth][width];
+	volatile LONG					epoch_;		// GetTickCount() of last decay
+	volatile LONG					listed_;	// slots ever used on blacklist
+	shard							shards_[shards];
+
+	static unsigned long hash(unsigned long key)
+	{
+		key = ((key >> 16) ^ key) * 0x45D9F3BUL;
+		key = ((key >> 16) ^ key) * 0x45D9F3BUL;
+		return (key >> 16) ^ key;
+	}
+
+	unsigned long count(unsigned long key);
+	unsigned long count(const void* session, const void* message);
+	void decay(DWORD window);
+	void blacklist(unsigned long ip, DWORD duration);
+
+public:
+	harvest();
+
+	// true if client is still on blacklist
+	bool blacklisted(unsigned long ip);
+
+	// count recipient rejected by internal SMTP server. Returns true if
+	// session should be dropped, i.e. there were at least session_threshold
+	// rejected recipients in this session or at
+	// least client_threshold from this client IP; in the later case client
+	// is also blacklisted for duration seconds. Threshold 0 means no limit,
+	// window is in seconds.
+	bool denied(unsigned long ip, const void* session, const void* message, unsigned int session_threshold,
+		unsigned int client_threshold, unsigned int window, unsigned int duration);
+};
@@ -0,0 +1,65 @@
+// limiter.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "limiter.hpp"
+
+limiter::bucket& limiter::find(shard& s, unsigned long ip, unsigned long h, DWORD now)
+{
+	// lowest bits of hash were used to select shard
+	const unsigned int first = (h >> 4) % slots;
+	bucket* oldest = NULL;
+	for (unsigned int i = 0; i < probe; ++i)
+	{
+		bucket& b = s.buckets[(first + i) % slots];
+		if (b.ip == ip || b.ip == 0)
+			return b;
+
+		// GetTickCount() wraps around after 49.7 days, unsigned arithmetic takes care of it
+		if (oldest == NULL || now - b.stamp > now - oldest->stamp)
+			oldest = &b;
+	}
+
+	return *oldest;
+}
+
+bool limiter::allow(unsigned long ip, unsigned int rate, unsigned int burst)
+{
+	if (rate == 0)
+		return true;
+	if (burst == 0)
+		burst = rate;
+
+	const unsigned long h = hash(ip);
+	shard& s = shards_[h % shards];
+	const unsigned __int64 capacity = static_cast<unsigned __int64> (burst) * unit_;
+
+	const sync::scoped_lock& g = sync::acquire(s.lock);
+	const DWORD now = GetTickCount();
+	bucket& b = find(s, ip, h, now);
+	if (b.ip != ip)
+	{
+		// new client or takeover of least recently used bucket
+		b.ip = ip;
+		b.tokens = capacity;
+	}
+	else
+	{
+		const DWORD elapsed = now - b.stamp;
+		if (elapsed >= capacity / rate)
+			b.tokens = capacity;
+		else
+			b.tokens = std::min(capacity, b.tokens + static_cast<unsigned __int64> (elapsed) * rate);
+	}
+	b.stamp = now;
+
+	if (b.tokens < unit_)
+		return false;
+
+	b.tokens -= unit_;
+	return true;
+}
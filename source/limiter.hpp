@@ -0,0 +1,70 @@
+// limiter.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Token bucket rate limiter, keyed on client IP address. Buckets are kept
+// in fixed number of shards, each one having its own lock and fixed number
+// of slots, thus memory used does not depend on number of clients seen.
+// When there is no free slot for new client, least recently used bucket
+// within probing distance is taken over.
+class limiter
+{
+public:
+	static const unsigned int shards = 16;
+	static const unsigned int slots = 1024;		// in each shard
+	static const unsigned int probe = 8;		// max. probing distance
+
+private:
+	// non-copyable and non-assignable
+	limiter(const limiter&);
+	limiter& operator=(const limiter&);
+
+	static const unsigned int spin_ = 4000;
+
+	// one token is worth as many units as there are milliseconds in a
+	// minute, thus rate (in tokens per minute) equals units per millisecond
+	static const unsigned int unit_ = 60000;
+
+	struct bucket
+	{
+		unsigned long				ip;		// 0 means empty slot
+		DWORD						stamp;	// GetTickCount() of last update
+		unsigned __int64			tokens;	// in units
+	};
+
+	struct shard
+	{
+		win32::critical_section		lock;
+		std::vector<bucket>			buckets;
+
+		shard() : lock(spin_), buckets(slots) {}
+	};
+
+	shard							shards_[shards];
+
+	static unsigned long hash(unsigned long ip)
+	{
+		// integer mixing, so that all bits of address affect shard and slot
+		ip = ((ip >> 16) ^ ip) * 0x45D9F3BUL;
+		ip = ((ip >> 16) ^ ip) * 0x45D9F3BUL;
+		return (ip >> 16) ^ ip;
+	}
+
+	static bucket& find(shard& s, unsigned long ip, unsigned long h, DWORD now);
+
+public:
+	limiter() {}
+
+	// take one token from the bucket of given client. Returns false if
+	// client is over the limit, that is there are no tokens left. Rate is
+	// number of tokens per minute (0 means no limit) and burst is capacity
+	// of the bucket (0 means same as rate)
+	bool allow(unsigned long ip, unsigned int rate, unsigned int burst);
+};
@@ -0,0 +1,245 @@
+// listener.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "listener.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+stats::probe p_accept("accept");
+
+const unsigned int max_message = 500;
+const unsigned int spin = 4000;
+
+// blocking send of whole data
+bool send_all(SOCKET s, const std::string& data)
+{
+	for (size_t sent = 0; sent < data.size(); )
+	{
+		const int result = send(s, data.data() + sent, static_cast<int> (data.size() - sent), 0);
+		if (result == SOCKET_ERROR || result == 0)
+			return false;
+		sent += result;
+	}
+
+	return true;
+}
+
+} // unnamed namespace
+
+listener::listener(protocol& p, const tcp::ip4_host& address, unsigned int threads) :
+	protocol_(p),
+	socket_(INVALID_SOCKET),
+	lock_(spin)
+{
+	port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if (*port_ == NULL)
+		throw error("Unable to create IO completion port");
+
+	// accepted sockets inherit overlapped mode from listening one
+	socket_ = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if (socket_ == INVALID_SOCKET)
+		tcp::error::last("WSASocket");
+
+	sockaddr_in saddr = {AF_INET, htons(address.port())};
+	saddr.sin_addr.s_addr = address.ip();
+	if (bind(socket_, reinterpret_cast<SOCKADDR*> (&saddr), sizeof(saddr)) == SOCKET_ERROR
+		|| listen(socket_, SOMAXCONN) == SOCKET_ERROR)
+	{
+		const int err = WSAGetLastError();
+		closesocket(socket_);
+		WSASetLastError(err);
+		tcp::error::last("bind");
+	}
+
+	threads = std::max(1U, std::min(threads, max_threads));
+	for (unsigned int i = 0; i < threads; ++i)
+	{
+		DWORD id = 0;
+		const HANDLE t = CreateThread(NULL, 0, &worker_thread, this, 0, &id);
+		if (t == NULL)
+			break;
+		threads_.push_back(t);
+	}
+
+	if (threads_.empty())
+	{
+		closesocket(socket_);
+		throw error("Unable to create worker thread");
+	}
+}
+
+listener::~listener()
+{
+	closesocket(socket_);
+
+	// pending reads will complete, and their threads will close connections
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		for (std::set<connection*>::const_iterator i = connections_.begin(); i != connections_.end(); ++i)
+			shutdown((*i)->socket, SD_BOTH);
+	} // free lock_
+
+	for (DWORD waited = 0; waited < drain_timeout_; waited += 10)
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		if (connections_.empty())
+			break;
+		g.unlock();
+		Sleep(10);
+	}
+
+	for (size_t i = 0; i < threads_.size(); ++i)
+		PostQueuedCompletionStatus(*port_, 0, 0, NULL);
+	for (size_t i = 0; i < threads_.size(); ++i)
+	{
+		WaitForSingleObject(threads_[i], INFINITE);
+		CloseHandle(threads_[i]);
+	}
+
+	// workers are gone, but remaining connections still have reads pending.
+	// Closing socket cancels the read, and its completion is still queued to
+	// the port; connection is deleted only after its completion has been
+	// dequeued, because until then the system may write to its OVERLAPPED
+	// and buffer. Connections whose reads did not complete are leaked
+	for (std::set<connection*>::const_iterator i = connections_.begin(); i != connections_.end(); ++i)
+		closesocket((*i)->socket);
+
+	while (!connections_.empty())
+	{
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* o = NULL;
+		GetQueuedCompletionStatus(*port_, &bytes, &key, &o, drain_timeout_);
+		if (o == NULL)
+			break; // timeout
+
+		connection* const c = reinterpret_cast<connection*> (o);
+		if (connections_.erase(c) != 0)
+			delete c;
+	}
+}
+
+void listener::run()
+{
+	for (;;)
+	{
+		const SOCKET s = accept(socket_, NULL, NULL);
+		if (s == INVALID_SOCKET)
+		{
+			// client gone before it was accepted
+			if (WSAGetLastError() == WSAECONNRESET)
+				continue;
+			return;
+		}
+
+		stats::count(p_accept);
+		connection* c = new (std::nothrow) connection;
+		if (c == NULL || CreateIoCompletionPort(reinterpret_cast<HANDLE> (s), *port_, 0, 0) == NULL)
+		{
+			delete c;
+			closesocket(s);
+			continue;
+		}
+
+		// replies are sent with blocking send, which must not wait forever for
+		// client which does not read. Timeout works for overlapped sockets only
+		const DWORD timeout = send_timeout_;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*> (&timeout), sizeof(timeout));
+
+		c->socket = s;
+		try
+		{
+			const sync::scoped_lock& g = sync::acquire(lock_);
+			connections_.insert(c);
+		}
+		catch (const std::exception&)
+		{
+			delete c;
+			closesocket(s);
+			continue;
+		}
+
+		if (!receive(c))
+			close(c);
+	}
+}
+
+bool listener::receive(connection* c)
+{
+	memset(&c->overlapped, 0, sizeof(c->overlapped));
+	WSABUF buffer = {buffer_size, c->buffer};
+	DWORD flags = 0;
+
+	// completion is queued to the port even if read completes immediately
+	if (WSARecv(c->socket, &buffer, 1, NULL, &flags, &c->overlapped, NULL) == SOCKET_ERROR
+		&& WSAGetLastError() != WSA_IO_PENDING)
+		return false;
+	return true;
+}
+
+void listener::close(connection* c)
+{
+	closesocket(c->socket);
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		connections_.erase(c);
+	} // free lock_
+	delete c;
+}
+
+DWORD WINAPI listener::worker_thread(void* pv)
+{
+	static_cast<listener*> (pv)->work();
+	return 0;
+}
+
+void listener::work()
+{
+	for (;;)
+	{
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* o = NULL;
+		const BOOL ok = GetQueuedCompletionStatus(*port_, &bytes, &key, &o, INFINITE);
+		if (o == NULL)
+			return; // stopped
+
+		// read failed or client disconnected
+		connection* const c = reinterpret_cast<connection*> (o);
+		if (!ok || bytes == 0)
+		{
+			close(c);
+			continue;
+		}
+
+		try
+		{
+			c->pending.append(c->buffer, bytes);
+			std::string reply;
+			const size_t used = protocol_.on_recv(c->pending.data(), c->pending.size(), reply);
+			if (used == npos || !send_all(c->socket, reply))
+			{
+				close(c);
+				continue;
+			}
+
+			c->pending.erase(0, used);
+			if (c->pending.size() > max_pending || !receive(c))
+				close(c);
+		}
+		catch (const std::exception& e)
+		{
+			char message[max_message];
+			if (str::format(std::nothrow, message, "Exception in %s, %s : %s\n", __FUNCTION__, typeid(e).name(), e.what()))
+				OutputDebugStringA(message);
+			close(c);
+		}
+	}
+}
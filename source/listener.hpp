@@ -0,0 +1,84 @@
+// listener.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "socket.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// TCP server of front-end protocols, e.g. Postfix policy delegation. All
+// connections are bound to single IO completion port, and served by fixed
+// number of threads: thread which receives data from the client passes it
+// to protocol, sends back replies and starts next read. There is at most
+// one read pending for each connection, thus protocol sees requests of one
+// client in order. Requests are answered by the thread which received them,
+// so number of threads is also number of requests verified at the same time.
+class listener
+{
+public:
+	struct error : public tcp::error
+	{
+		explicit error(const char* msg) : tcp::error(msg) {}
+	};
+
+	// protocol spoken by clients. Must be safe for calls from many threads
+	class protocol
+	{
+	public:
+		// answer complete requests found at the start of data, appending
+		// replies in order of requests. Returns number of bytes consumed, or
+		// npos if client violated protocol and should be disconnected
+		virtual size_t on_recv(const char* data, size_t len, std::string& reply) = 0;
+
+	protected:
+		~protocol() {}
+	};
+
+	static const size_t npos = ~static_cast<size_t> (0);
+	static const unsigned int buffer_size = 4096;
+	static const size_t max_pending = 65536;	// of data not consumed by protocol
+	static const unsigned int max_threads = 64;
+
+private:
+	// non-copyable and non-assignable
+	listener(const listener&);
+	listener& operator=(const listener&);
+
+	static const DWORD drain_timeout_ = 1000;	// milliseconds
+	static const DWORD send_timeout_ = 30000;	// milliseconds
+
+	struct connection
+	{
+		OVERLAPPED					overlapped;	// of pending read
+		SOCKET						socket;
+		char						buffer[buffer_size];
+		std::string					pending;
+	};
+
+	protocol&						protocol_;
+	SOCKET							socket_;
+	win32::handle					port_;
+	std::vector<HANDLE>				threads_;
+	win32::critical_section			lock_;		// guards connections_
+	std::set<connection*>			connections_;
+
+	static DWORD WINAPI worker_thread(void* pv);
+	void work();
+	bool receive(connection* c);
+	void close(connection* c);
+
+public:
+	// start listening on given address. Caller must initialize Winsock (see
+	// tcp::startup) before and keep it until this object is destroyed
+	listener(protocol& p, const tcp::ip4_host& address, unsigned int threads);
+
+	// disconnect all clients
+	~listener();
+
+	// accept clients, until listening socket fails
+	void run();
+};
@@ -7,11 +7,16 @@
 #include "stdafx.h"
 
 #include "metabase.hpp"
+#include "stats.hpp"
 
 namespace
 {
 
+stats::probe p_load("metabase_load");
+
 const int max_binding_string = 1000;
+const size_t initial_values = 4096;
+const int load_attempts = 3;
 
 // used only inside mbpath2wstring() ; "Configuration" also defined in sink2.cpp
 const wchar_t* const mbpath_format = L"/LM/SmtpSvc/%d/EventManager/EventTypes/%s/Bindings/%s/SinkProperties/Configuration";
@@ -26,7 +31,10 @@ std::wstring mbpath2wstring(const metabase::path& path)
 
 } // unnamed namespace
 
-metabase::metabase(const metabase::path& path) : mbpath_(mbpath2wstring(path))
+metabase::metabase(const metabase::path& path) :
+	mbpath_(mbpath2wstring(path)),
+	values_(initial_values),
+	count_(0)
 {
 	com::enforce(metabase_.CoCreateInstance(CLSID_MSAdminBase, 0, CLSCTX_INPROC_SERVER | CLSCTX_LOCAL_SERVER));
 }
@@ -44,7 +52,68 @@ void metabase::read(METADATA_RECORD& record, DWORD &size)
 	com::enforce(this->read(record, size, std::nothrow));
 }
 
+HRESULT metabase::load(const std::nothrow_t&)
+{
+	const stats::scope s_load(p_load);
+	const sync::scoped_lock& g = sync::acquire(lock_);
+	count_ = 0;
+
+	// values might grow between calls, thus more than one attempt
+	HRESULT hr = S_OK;
+	for (int i = 0; i < load_attempts; ++i)
+	{
+		DWORD count = 0;
+		DWORD dataset = 0;
+		DWORD required = 0;
+		hr = metabase_->GetAllData(METADATA_MASTER_ROOT_HANDLE, mbpath_.c_str(), METADATA_NO_ATTRIBUTES,
+			ALL_METADATA, ALL_METADATA, &count, &dataset, static_cast<DWORD> (values_.size()), &values_[0], &required);
+		if (hr != HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+		{
+			if (SUCCEEDED(hr))
+				count_ = count;
+			return hr;
+		}
+
+		values_.resize(required);
+	}
+
+	return hr;
+}
+
+void metabase::load()
+{
+	com::enforce(this->load(std::nothrow));
+}
+
+const unsigned char* metabase::find(DWORD id, DWORD type, DWORD& size) const
+{
+	// data is returned by value, following records in the same buffer
+	const METADATA_GETALL_RECORD* records = reinterpret_cast<const METADATA_GETALL_RECORD*> (&values_[0]);
+	for (DWORD i = 0; i < count_; ++i)
+	{
+		const METADATA_GETALL_RECORD& r = records[i];
+		if (r.dwMDIdentifier == id && r.dwMDDataType == type
+			&& r.dwMDDataOffset <= values_.size() && r.dwMDDataLen <= values_.size() - r.dwMDDataOffset)
+		{
+			size = r.dwMDDataLen;
+			return &values_[r.dwMDDataOffset];
+		}
+	}
+
+	return NULL;
+}
+
 HRESULT metabase::write(METADATA_RECORD& record, const std::nothrow_t&)
+{
+	return write(&record, 1, std::nothrow);
+}
+
+void metabase::write(METADATA_RECORD& record)
+{
+	com::enforce(this->write(record, std::nothrow));
+}
+
+HRESULT metabase::write(METADATA_RECORD* records, size_t count, const std::nothrow_t&)
 {
 	const sync::scoped_lock& g = sync::acquire(lock_);
 
@@ -53,12 +122,14 @@ HRESULT metabase::write(METADATA_RECORD& record, const std::nothrow_t&)
 	if (FAILED(hr))
 		return hr;
 
-	hr = metabase_->SetData(handle, L"", &record);
+	for (size_t i = 0; i < count && SUCCEEDED(hr); ++i)
+		hr = metabase_->SetData(handle, L"", &records[i]);
+
 	metabase_->CloseKey(handle);
 	return hr;
 }
 
-void metabase::write(METADATA_RECORD& record)
+void metabase::write(METADATA_RECORD* records, size_t count)
 {
-	com::enforce(this->write(record, std::nothrow));
+	com::enforce(this->write(records, count, std::nothrow));
 }
@@ -39,6 +39,8 @@ private:
 	const std::wstring					mbpath_;
 	CComPtr<IMSAdminBase>				metabase_;
 	win32::critical_section				lock_;
+	std::vector<unsigned char>			values_;
+	DWORD								count_;
 
 	// non-copyable and non-assignable
 	metabase(const metabase&);
@@ -54,8 +56,24 @@ public:
 
 	void read(METADATA_RECORD& record, DWORD& size);
 
+	// Read all values of configuration key with single call, to be found
+	// later with find. Buffer is reused by next load, thus caller must
+	// make sure that nobody else is using this object in the meantime
+	HRESULT load(const std::nothrow_t&);
+
+	void load();
+
+	// value of given identifier and type from last load, NULL if not found
+	const unsigned char* find(DWORD id, DWORD type, DWORD& size) const;
+
 	HRESULT write(METADATA_RECORD& record, const std::nothrow_t&);
 
 	void write(METADATA_RECORD& record);
+
+	// write all records with key opened once. Key is not kept open, as
+	// it would block other writers (e.g. IIS administration tools)
+	HRESULT write(METADATA_RECORD* records, size_t count, const std::nothrow_t&);
+
+	void write(METADATA_RECORD* records, size_t count);
 };
 
@@ -0,0 +1,95 @@
+// postfix.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "postfix.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+stats::probe p_policy("policy_request");
+
+const char* const dunno = "action=DUNNO\n\n";
+
+// value of attribute in line "name=value", or NULL if line has other name
+const char* value(const char* first, const char* last, const char* name, size_t len)
+{
+	if (static_cast<size_t> (last - first) <= len || first[len] != '=' || memcmp(first, name, len) != 0)
+		return NULL;
+	return first + len + 1;
+}
+
+} // unnamed namespace
+
+size_t postfix::on_recv(const char* data, size_t len, std::string& reply)
+{
+	// recipients of all complete requests, in order. Empty one is not verified
+	std::vector<service::recipient> rcpts;
+	const char* const end = data + len;
+	const char* p = data;
+	for (;;)
+	{
+		const char* const request = p;
+		std::string rcpt;
+		bool rcpt_state = false;
+		bool complete = false;
+		while (p != end)
+		{
+			const char* eol = static_cast<const char*> (memchr(p, '\n', end - p));
+			if (eol == NULL)
+				break;
+
+			const char* const first = p;
+			p = eol + 1;
+			if (first == eol)
+			{
+				complete = true;
+				break;
+			}
+
+			const char* v = NULL;
+			if ((v = value(first, eol, "recipient", 9)) != NULL)
+				rcpt.assign(v, eol);
+			else if ((v = value(first, eol, "protocol_state", 14)) != NULL)
+				rcpt_state = (eol - v == 4 && memcmp(v, "RCPT", 4) == 0);
+		}
+
+		if (!complete)
+		{
+			// rest is incomplete request, unless it's too long to be one
+			if (static_cast<size_t> (end - request) > max_request)
+				return listener::npos;
+			p = request;
+			break;
+		}
+
+		rcpts.push_back(service::recipient());
+		if (rcpt_state)
+			rcpts.back().rcpt = rcpt;
+	}
+
+	if (rcpts.empty())
+		return 0;
+
+	const stats::scope s_policy(p_policy);
+	service_.verify(&rcpts[0], rcpts.size());
+	for (size_t i = 0; i < rcpts.size(); ++i)
+	{
+		if (rcpts[i].result != service::rejected)
+		{
+			reply += dunno;
+			continue;
+		}
+
+		reply += "action=";
+		reply += service_.rejection(rcpts[i].rcpt);
+		reply += "\n\n";
+	}
+
+	return p - data;
+}
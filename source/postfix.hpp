@@ -0,0 +1,32 @@
+// postfix.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "listener.hpp"
+#include "service.hpp"
+
+// Postfix policy delegation protocol (see SMTPD_POLICY_README of Postfix,
+// check_policy_service restriction). Request is list of "name=value" lines
+// terminated by empty line; recipient in protocol state RCPT is verified,
+// and reply is "action=DUNNO" (accepted or not verified, further
+// restrictions of Postfix decide) or "action=550 text" (rejected). All
+// requests received together are verified together.
+class postfix : public listener::protocol
+{
+	// non-copyable and non-assignable
+	postfix(const postfix&);
+	postfix& operator=(const postfix&);
+
+	static const size_t max_request = 8192;
+
+	service&						service_;
+
+public:
+	explicit postfix(service& s) : service_(s) {}
+
+	size_t on_recv(const char* data, size_t len, std::string& reply);
+};
@@ -0,0 +1,120 @@
+// refresher.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "refresher.hpp"
+
+namespace
+{
+
+const unsigned int max_message = 500;
+
+} // unnamed namespace
+
+DWORD WINAPI refresh_thread(void* pv);
+
+refresher::refresher() :
+	stop_(false)
+{
+	event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (*event_ == NULL)
+		throw sync::error("CreateEvent failed");
+}
+
+bool refresher::schedule(const sync::shared<config>& c, const backend::ref& b, const sync::shared<cache>& s,
+	const std::string& rcpt, unsigned __int64 key)
+{
+	const sync::scoped_lock& g = sync::acquire(lock_);
+	if (stop_ || queue_.size() >= max_queue || pending_.find(key) != pending_.end())
+		return false;
+
+	if (*thread_ == NULL)
+	{
+		DWORD id;
+		thread_ = CreateThread(NULL, 0, &refresh_thread, this, 0, &id);
+		if (*thread_ == NULL)
+			return false;
+	}
+
+	job j;
+	j.configuration = c;
+	j.server = b;
+	j.store = s;
+	j.rcpt = rcpt;
+	j.key = key;
+	queue_.push_back(j);
+	pending_.insert(key);
+	SetEvent(*event_);
+	return true;
+}
+
+void refresher::stop()
+{
+	{
+		const sync::scoped_lock& g = sync::acquire(lock_);
+		stop_ = true;
+		queue_.clear();
+		pending_.clear();
+		SetEvent(*event_);
+	} // free lock_
+
+	if (*thread_ != NULL)
+		WaitForSingleObject(*thread_, INFINITE);
+}
+
+void refresher::run()
+{
+	for (;;)
+	{
+		job j;
+		{
+			const sync::scoped_lock& g = sync::acquire(lock_);
+			if (stop_)
+				return;
+			if (queue_.empty())
+			{
+				g.unlock();
+				WaitForSingleObject(*event_, INFINITE);
+				continue;
+			}
+
+			j = queue_.front();
+			queue_.pop_front();
+		} // free lock_
+
+		const config& c = *j.configuration;
+		bool allow = true;
+		bool verified = false;
+		try
+		{
+			verified = j.server->verify(c, j.rcpt, allow);
+		}
+		catch (const std::exception& e)
+		{
+			char message[max_message];
+			if (str::format(std::nothrow, message, "Exception in %s, %s : %s\n", __FUNCTION__, typeid(e).name(), e.what()))
+				OutputDebugStringA(message);
+		}
+
+		{
+			const sync::scoped_lock& g = sync::acquire(lock_);
+			pending_.erase(j.key);
+		} // free lock_
+
+		if (!verified)
+			continue;
+
+		if (j.store.get() != NULL)
+			j.store->insert(j.key, allow, c.cache_ttl + c.cache_stale + c.cache_grace);
+	}
+}
+
+DWORD WINAPI refresh_thread(void* pv)
+{
+	static_cast<refresher*> (pv)->run();
+	return 0;
+}
@@ -0,0 +1,65 @@
+// refresher.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "backend.hpp"
+#include "cache.hpp"
+#include "config.hpp"
+#include "util_ptr.hpp"
+#include "util_synch.hpp"
+#include "util_win32.hpp"
+
+// Background refresh of cached verdicts past their time to live. Sink
+// keeps serving such verdict and schedules its refresh here; single thread
+// (started with first refresh) verifies scheduled recipients and stores
+// new verdicts in the cache. Queue is bounded, and the same recipient is
+// never scheduled twice.
+class refresher
+{
+public:
+	static const size_t max_queue = 1000;
+
+private:
+	// non-copyable and non-assignable
+	refresher(const refresher&);
+	refresher& operator=(const refresher&);
+
+	struct job
+	{
+		sync::shared<config>		configuration;
+		backend::ref				server;
+		sync::shared<cache>			store;
+		std::string					rcpt;
+		unsigned __int64			key;
+	};
+
+	win32::critical_section			lock_;		// guards all below
+	std::deque<job>					queue_;
+	std::set<unsigned __int64>		pending_;
+	win32::handle					event_;
+	win32::handle					thread_;
+	bool							stop_;
+
+	friend DWORD WINAPI refresh_thread(void* pv);
+
+	void run();
+
+public:
+	refresher();
+
+	~refresher()
+	{
+		stop();
+	}
+
+	// false if recipient cannot be scheduled, e.g. queue is full
+	bool schedule(const sync::shared<config>& c, const backend::ref& b, const sync::shared<cache>& s,
+		const std::string& rcpt, unsigned __int64 key);
+
+	// drop all scheduled refreshes and wait for thread to finish
+	void stop();
+};
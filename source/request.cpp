@@ -8,46 +8,118 @@
 
 #include "request.hpp"
 
+namespace
+{
+
+inline void assign(WSABUF& buffer, const char* data, size_t len)
+{
+	// I promise that this data won't be modified
+	buffer.buf = const_cast<char*> (data);
+	buffer.len = static_cast<u_long> (len);
+}
+
+// "verb <address>\r\n" in buffers, without copying address
+void command(WSABUF* buffers, const char* verb, const char* address, size_t len)
+{
+	const bool bare = (*address != '<');
+	assign(buffers[0], verb, strlen(verb));
+	assign(buffers[1], "<", bare ? 1 : 0);
+	assign(buffers[2], address, len);
+	assign(buffers[3], bare ? ">\r\n" : "\r\n", bare ? 3 : 2);
+}
+
+} // unnamed namespace
+
 bool request::operator() (const std::string& rcpt)
 {
 	if (rcpt.empty())
 		return false;
 
-	std::string from(config_.protocol_from);
-	if (from.empty())
+	const char* from = config_.protocol_from;
+	if (*from == '\0')
 		return false;
 
-	std::string cmd = "MAIL FROM: ";
-	if (from[0] != '<')
+	WSABUF buffers[4];
+	command(buffers, "MAIL FROM: ", from, strlen(from));
+
+	unsigned int code = 0;
+	if (socket_.send_recv(buffers, 4, code, deadline_) != tcp::success)
+		return false;
+	if (code >= 300)
 	{
-		cmd += "<";
-		cmd += from;
-		cmd += ">";
+		socket_.close();
+		return false;
 	}
-	else
-		cmd += from;
-	cmd += "\r\n";
 
-	const sync::scoped_lock& g = sync::acquire(socket_);
+	command(buffers, "RCPT TO: ", rcpt.data(), rcpt.size());
+	if (socket_.send_recv(buffers, 4, code, deadline_) != tcp::success)
+		return false;
 
-	if (socket_.send_recv(cmd) >= 300)
-	{
-		socket_.disc();
+	code_ = code;
+	allow_ = (code < 300);
+	return is_final(code);
+}
+
+bool request::operator() (const std::vector<const std::string*>& rcpts)
+{
+	const char* from = config_.protocol_from;
+	if (*from == '\0' || rcpts.empty())
 		return false;
-	}
 
-	cmd = "RCPT TO: ";
-	if (rcpt[0] != '<')
+	// four buffers for each command
+	const size_t count = rcpts.size() + 1;
+	std::vector<WSABUF> buffers(4 * count);
+	command(&buffers[0], "MAIL FROM: ", from, strlen(from));
+	for (size_t i = 0; i < rcpts.size(); ++i)
+		command(&buffers[4 * (i + 1)], "RCPT TO: ", rcpts[i]->data(), rcpts[i]->size());
+
+	std::vector<unsigned int> codes(count);
+	if (socket_.send_recv(&buffers[0], static_cast<DWORD> (buffers.size()), &codes[0],
+			static_cast<unsigned int> (count), deadline_) != tcp::success)
+		return false;
+	if (codes[0] >= 300)
 	{
-		cmd += "<";
-		cmd += rcpt;
-		cmd += ">";
+		socket_.close();
+		return false;
 	}
-	else
-		cmd += rcpt;
-	cmd += "\r\n";
 
-	allow_ = (socket_.send_recv(cmd) < 300);
+	codes_.assign(codes.begin() + 1, codes.end());
 	return true;
 }
 
+request::status request::vrfy(const std::string& rcpt)
+{
+	if (rcpt.empty())
+		return undecided;
+
+	// address without angle brackets, as some servers do not accept them here
+	WSABUF buffers[3];
+	assign(buffers[0], "VRFY ", 5);
+	assign(buffers[1], rcpt.data(), rcpt.size());
+	assign(buffers[2], "\r\n", 2);
+
+	unsigned int code = 0;
+	if (socket_.send_recv(buffers, 3, code, deadline_) != tcp::success)
+		return failed;
+	code_ = code;
+
+	// RFC 2821, 3.5.3 and 4.3.2
+	switch (code)
+	{
+	case 250:
+	case 251:
+		allow_ = true;
+		return answered;
+	case 550:
+	case 551:
+	case 553:
+		allow_ = false;
+		return answered;
+	case 252:	// cannot verify, but will accept message
+	case 500:
+	case 502:
+		return unsupported;
+	}
+
+	return undecided;
+}
@@ -16,22 +16,57 @@ class request
 	request& operator=(const request&);
 	request(const request& other);
 
-	const config			config_;
-	timer					timer_;
+	const config&			config_;
 	smtp&					socket_;
+	const deadline&			deadline_;
 	bool					allow_;
+	unsigned int			code_;		// reply to RCPT or VRFY
+	std::vector<unsigned int> codes_;	// replies to RCPT of pipelined request
 
 public:
-	request(const config& c, smtp& sc) : 
+	// MAIL and RCPT commands must be completed before deadline. Caller
+	// must own lock of sc
+	request(const config& c, smtp& sc, const deadline& d) : 
 		config_(c), 
 		socket_(sc),
-		allow_(false)
+		deadline_(d),
+		allow_(false),
+		code_(0)
 	{}
 
 	~request() {}
 
+	// answer to VRFY
+	enum status
+	{
+		answered,		// see allowed
+		unsupported,	// server does not verify mailboxes with VRFY
+		undecided,		// server would not tell about this mailbox
+		failed			// connection is lost
+	};
+
+	// reply which will not change when asked again, i.e. success or
+	// permanent failure (RFC 2821, 4.2.1). Temporary failure (4xx), e.g.
+	// greylisting or too many recipients, is not a verdict
+	static bool is_final(unsigned int code)
+	{
+		return (code >= 200 && code < 300) || (code >= 500 && code < 600);
+	}
+
+	// MAIL and RCPT. False if verification was not completed, also if reply
+	// to RCPT is not final
 	bool operator() (const std::string& rcpt);
 
+	// MAIL and RCPT for each of recipients, all sent in single write as
+	// allowed by RFC 2920. Server must support pipelining, see
+	// smtp::pipelining. False if verification was not completed, see also
+	// verified
+	bool operator() (const std::vector<const std::string*>& rcpts);
+
+	// single VRFY command, without MAIL. Recipient which is not answered
+	// should be verified with MAIL and RCPT
+	status vrfy(const std::string& rcpt);
+
 	bool allowed() const
 	{
 		return allow_;
@@ -41,4 +76,27 @@ public:
 	{
 		return !allow_;
 	}
+
+	// reply to RCPT or VRFY
+	unsigned int code() const
+	{
+		return code_;
+	}
+
+	// false if reply to i-th recipient of pipelined request is not final
+	bool verified(size_t i) const
+	{
+		return is_final(codes_[i]);
+	}
+
+	// verdict of i-th recipient of pipelined request
+	bool allowed(size_t i) const
+	{
+		return codes_[i] < 300;
+	}
+
+	unsigned int code(size_t i) const
+	{
+		return codes_[i];
+	}
 };
@@ -0,0 +1,137 @@
+// service.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "service.hpp"
+#include "address.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+
+namespace
+{
+
+stats::probe p_service("service_verify");
+
+const unsigned int max_message = 500;
+
+} // unnamed namespace
+
+service::service(const config& c) :
+	config_(c),
+	backend_(c)
+{
+	directory_.check(config_.directory_file);
+
+	if (config_.cache_ttl == 0)
+		return;
+
+	try
+	{
+		sync::shared<cache> created(new cache(config_.cache_file, config_.cache_size));
+		cache_.swap(created);
+	}
+	catch (const cache::error& e)
+	{
+		// front-end can do without cache, just like sink
+		char message[max_message] = {0};
+		if (str::format(std::nothrow, message, "Exception in %s, cache::error : %s\n", __FUNCTION__, e.what()))
+			OutputDebugStringA(message);
+	}
+}
+
+std::string service::rejection(const std::string& rcpt) const
+{
+	std::string result;
+	str::format(result, "%03u %s", config_.rcpt_status % 1000, config_.rcpt_response);
+	if (config_.rcpt_append)
+		result += rcpt;
+	return result;
+}
+
+void service::verify(recipient* rcpts, size_t count)
+{
+	const config& c = config_;
+	stats::report(c.stats_interval, c.stats_file);
+	directory_.check(c.directory_file);
+	const stats::scope s_service(p_service);
+
+	// verdicts in cache past their time to live are used only if internal
+	// server cannot be asked
+	const unsigned long retention = c.cache_ttl + c.cache_stale + c.cache_grace;
+	std::vector<backend::recipient> batch;
+	std::vector<size_t> index;
+	std::vector<unsigned __int64> keys;
+	std::vector<char> cached;	// 0 - none, 1 - allowed, 2 - denied
+	for (size_t i = 0; i < count; ++i)
+	{
+		// recipient is sent verbatim to internal server, thus anything but
+		// valid address (e.g. with CR LF) is left unverified
+		recipient& r = rcpts[i];
+		r.result = unverified;
+		const char* begin = NULL;
+		const char* end = NULL;
+		if (address::parse(r.rcpt.c_str(), r.rcpt.size(), begin, end) != address::valid || *begin == '<')
+			continue;
+
+		const std::string canonical = c.canonical(std::string(begin, end));
+		if (!c.is_hosted(canonical))
+		{
+			if (c.foreign_deny)
+				r.result = rejected;
+			continue;
+		}
+
+		bool allow = true;
+		if (directory_.verify(c, canonical, allow))
+		{
+			r.result = allow ? accepted : rejected;
+			continue;
+		}
+
+		const unsigned __int64 key = cache::key(c.server_address, c.server_port, canonical);
+		unsigned long left = 0;
+		const bool found = cache_.get() != NULL && cache_->find(key, allow, left);
+		if (found && left > retention - c.cache_ttl)
+		{
+			r.result = allow ? accepted : rejected;
+			continue;
+		}
+
+		batch.push_back(backend::recipient());
+		batch.back().rcpt = canonical;
+		index.push_back(i);
+		keys.push_back(key);
+		cached.push_back(found ? (allow ? 1 : 2) : 0);
+	}
+
+	if (batch.empty())
+		return;
+
+	// single recipient may share pipelined request with other threads
+	if (batch.size() == 1)
+		batch[0].verified = backend_->verify(c, batch[0].rcpt, batch[0].allow);
+	else
+	{
+		const size_t share = (batch.size() + std::max(c.connections, 1U) - 1) / std::max(c.connections, 1U);
+		const size_t groups = (share + std::max(c.pipeline_depth, 1U) - 1) / std::max(c.pipeline_depth, 1U);
+		const deadline d(static_cast<unsigned long> (c.request_max_delay * groups));
+		backend_->verify_batch(c, &batch[0], batch.size(), d);
+	}
+
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		recipient& r = rcpts[index[i]];
+		if (batch[i].verified)
+		{
+			r.result = batch[i].allow ? accepted : rejected;
+			if (cache_.get() != NULL)
+				cache_->insert(keys[i], batch[i].allow, retention);
+		}
+		else if (cached[i] != 0)
+			r.result = cached[i] == 1 ? accepted : rejected;
+	}
+}
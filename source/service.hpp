@@ -0,0 +1,63 @@
+// service.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "backend.hpp"
+#include "cache.hpp"
+#include "config.hpp"
+#include "directory.hpp"
+#include "util_ptr.hpp"
+
+// Verification of recipients for front-ends serving other MTAs outside
+// IIS (see listener). Configuration of sink binding is read once, when
+// front-end is started. Recipients are checked the same way as in the
+// sink: domains not hosted by internal server, directory of mailboxes,
+// cache shared with the sink (if it uses cache file), and internal server.
+// Verdict which cannot be given (e.g. internal server is not available, or
+// recipient is not valid address) is left to the MTA, just like sink
+// accepts such recipients.
+class service
+{
+public:
+	enum verdict
+	{
+		accepted,
+		rejected,
+		unverified
+	};
+
+	struct recipient
+	{
+		std::string					rcpt;		// as sent by MTA
+		verdict						result;
+	};
+
+private:
+	// non-copyable and non-assignable
+	service(const service&);
+	service& operator=(const service&);
+
+	const config					config_;
+	backend::ref					backend_;
+	directory						directory_;
+	sync::shared<cache>				cache_;
+
+public:
+	explicit service(const config& c);
+
+	const config& configuration() const
+	{
+		return config_;
+	}
+
+	// recipients verified by internal server are verified together, see
+	// backend::verify_batch
+	void verify(recipient* rcpts, size_t count);
+
+	// text of rejection, "550 Unable to relay to rcpt" by default
+	std::string rejection(const std::string& rcpt) const;
+};
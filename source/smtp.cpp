@@ -6,40 +6,93 @@
 
 #include "stdafx.h"
 #include "smtp.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+stats::probe p_on_recv("on_recv");
+stats::contention connection_lock("connection");
+
+const unsigned long lock_spin = 4000;
+
+} // unnamed namespace
+
+DWORD WINAPI idle_thread(void* pv);
 
 smtp::smtp(const config& c) :
 	tcp::socket<smtp>(tcp::ip4_host(c.server_address, c.server_port)),
-	max_req_time_ms_(c.request_max_delay),
+	socket_lock_(connection_lock, lock_spin),
+	replies_(0),
+	expected_(1),
+	pipelining_(false),
 	idle_timeout_s_(c.conn_idle_timeout),
 	connected_(true),
 	max_connection_s_(c.conn_max_time),
 	configuration(c)
 {
-	if (recv() >= 300)
-		throw error("Protocol error : remote server is not ready");
-	if (send_recv(std::string("HELO ") + c.protocol_helo + "\r\n") >= 300)
-		throw error("Protocol error : remote server is not ready");
-
 	event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
 	if (*event_ == NULL)
 		throw error("Unable to create wait object");
-	
+}
+
+tcp::status smtp::open(const deadline& d)
+{
+	tcp::status result = tcp::socket<smtp>::open(d);
+	if (result != tcp::success)
+		return fail(result, "smtp::open");
+
+	unsigned int code = 0;
+	result = recv(code, d);
+	if (result != tcp::success)
+		return result;
+	if (code >= 300)
+		return fail(tcp::invalid, "smtp::open");
+
+	// EHLO is needed only to find out if server supports pipelining
+	if (configuration.pipeline_depth > 1)
+	{
+		result = send_recv(std::string("EHLO ") + configuration.protocol_helo + "\r\n", code, d);
+		if (result != tcp::success)
+			return result;
+
+		// first line is greeting, others are extensions
+		for (size_t i = 1; code < 300 && i < response_.size(); ++i)
+		{
+			if (_stricmp(response_[i].c_str() + 4, "PIPELINING") == 0)
+				pipelining_ = true;
+		}
+	}
+
+	if (configuration.pipeline_depth <= 1 || code >= 300)
+	{
+		result = send_recv(std::string("HELO ") + configuration.protocol_helo + "\r\n", code, d);
+		if (result != tcp::success)
+			return result;
+		if (code >= 300)
+			return fail(tcp::invalid, "smtp::open");
+	}
+
+	// idle timer starts when connection is ready
+	connection_timer_.reset();
 	DWORD id;
 	thread_ = CreateThread(NULL, 0, &idle_thread, this, 0, &id);
 	if (*thread_ == NULL)
 		throw error("Unable to create idle thread");
+
+	return tcp::success;
 }
 
-bool smtp::on_is_alive(const tcp::ip4_host& s)
+bool smtp::on_is_alive(const tcp::ip4_host& s, const deadline& d)
 {
 	try
 	{
-		const sync::scoped_lock& g = sync::acquire(socket_lock_);
-
-		reset_timer();
-		if (send_recv("RSET\r\n") > 300)
+		unsigned int code = 0;
+		if (send_recv("RSET\r\n", code, d) != tcp::success)
+			return false;
+		if (code > 300)
 		{
-			disc();
+			close();
 			return false;
 		}
 	}
@@ -52,69 +105,92 @@ bool smtp::on_is_alive(const tcp::ip4_host& s)
 }
 
 
-bool smtp::on_recv(char* data, unsigned int len)
+tcp::status smtp::on_recv(char* data, unsigned int len)
 {
+	const stats::scope s(p_on_recv);
 	for (unsigned int i = 0; i < len; ++i)
 	{
 		if (data[i] >= ' ') 
 			partial_response_ += data[i];
 		else if (data[i] == '\n')
 		{
+			// last line of reply is "code text", others are "code-text"
+			if (partial_response_.size() < minimum_partial_response_)
+				return tcp::invalid;
+			else if (partial_response_[3] == ' ')
+				++replies_;
+			else if (partial_response_[3] != '-')
+				return tcp::invalid;
+
 			response_.push_back(partial_response_);
 			partial_response_.clear();
 		}
 	}
 
-	if (!partial_response_.empty() || response_.size() == 0)
-		return true;
-
-	const std::string& last = response_[response_.size() - 1];
-	if (last.size() < minimum_partial_response_)
-		throw error("Protocol error : response from SMTP server is too short");
-	else if (last[3] == '-')
-		return true;
-	else  if (last[3] == ' ')
-		return false;
-	else
-		throw error("Protocol error : response from SMTP server is invalid");
+	if (!partial_response_.empty() || replies_ < expected_)
+		return tcp::pending;
+	return tcp::success;
 }
 
 
-unsigned int smtp::recv()
+tcp::status smtp::recv(unsigned int* codes, unsigned int count, const deadline& d)
 {
 	try
 	{
-		const sync::scoped_lock& g = sync::acquire(socket_lock_);
-		SetEvent(*event_);
-
-		std::vector<std::string>().swap(response_);
+		response_.clear();
 		partial_response_.clear();
+		replies_ = 0;
+		expected_ = count;
 
-		tcp::socket<smtp>::recv(timer_, max_req_time_ms_);
-
-		if (response_.size() == 0)
-			throw error("Protocol error : no response from SMTP server");
+		const tcp::status result = tcp::socket<smtp>::recv(d);
+		if (result != tcp::success)
+			return fail(result, "smtp::recv");
 
-		const std::string& last = response_[response_.size() - 1];
-		if (last.size() < minimum_partial_response_)
-			throw error("Protocol error : response from SMTP server is too short");
-		if (last[0] > '5' || last[0] < '2' ||
-			last[1] > '9' || last[1] < '0' ||
-			last[2] > '9' || last[2] < '0')
-			throw error("Protocol error : response from SMTP server is invalid");
+		// code of each reply is taken from its last line
+		unsigned int n = 0;
+		for (size_t i = 0; i < response_.size() && n < count; ++i)
+		{
+			const std::string& line = response_[i];
+			if (line[3] != ' ')
+				continue;
+			else if (line[0] > '5' || line[0] < '2'
+				|| line[1] > '9' || line[1] < '0'
+				|| line[2] > '9' || line[2] < '0')
+				return fail(tcp::invalid, "smtp::recv");
+
+			codes[n++] = (line[0] - '0') * 100
+				+ (line[1] - '0') * 10
+				+ (line[2] - '0');
+		}
 
-		return (last[0] - '0') * 100
-			+ (last[1] - '0') * 10
-			+ (last[2] - '0');
+		if (n != count)
+			return fail(tcp::invalid, "smtp::recv");
+		return tcp::success;
 	}
 	catch (std::exception&)
 	{
-		disc();
+		close();
 		throw;
 	}
 }
 
 
+tcp::status smtp::fail(tcp::status result, const char* function)
+{
+	char message[max_message_];
+	if (result == tcp::failure)
+	{
+		if (str::format(std::nothrow, message, "%s : %s %d\n", function, tcp::describe(result), last_error()))
+			OutputDebugStringA(message);
+	}
+	else if (str::format(std::nothrow, message, "%s : %s\n", function, tcp::describe(result)))
+		OutputDebugStringA(message);
+
+	close();
+	return result;
+}
+
+
 DWORD WINAPI idle_thread(void* pv)
 {
 	smtp* me = reinterpret_cast<smtp*> (pv);
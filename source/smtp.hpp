@@ -48,11 +48,13 @@ private:
 	static const bool close_gracefully_ = true;
 	
 	static const unsigned int minimum_partial_response_ = 4;
+	static const unsigned int max_message_ = 200;
 
-	timer timer_;
-	unsigned long max_req_time_ms_;
 	std::vector<std::string> response_;
 	std::string partial_response_;
+	unsigned int replies_;		// complete replies in response_
+	unsigned int expected_;		// replies to receive
+	bool pipelining_;
 	win32::critical_section socket_lock_;
 	win32::critical_section disconnecting_;
 	unsigned long idle_timeout_s_;
@@ -67,80 +69,134 @@ private:
 
 	friend inline sync::lock<win32::critical_section> sync::try_acquire(smtp&);
 
-	bool on_is_alive(const tcp::ip4_host& s);
+	bool on_is_alive(const tcp::ip4_host& s, const deadline& d);
 
-	bool on_recv(char* data, unsigned int len);
+	tcp::status on_recv(char* data, unsigned int len);
 
-	unsigned int recv();
+	tcp::status recv(unsigned int* codes, unsigned int count, const deadline& d);
+
+	tcp::status recv(unsigned int& code, const deadline& d)
+	{
+		return recv(&code, 1, d);
+	}
+
+	// disconnect, caller must own lock
+	void close()
+	{
+		const sync::scoped_lock& d = sync::acquire(disconnecting_);
+		connected_ = false;
+
+		SetEvent(*event_);
+		tcp::socket<smtp>::disc("QUIT\r\n");
+	}
+
+	// log and disconnect
+	tcp::status fail(tcp::status result, const char* function);
 
 	friend DWORD WINAPI idle_thread(void* pv);
 
+	// closes connection after failed MAIL, while owning the lock
+	friend class request;
+
 public:
 	const config configuration;
 
+	// does not connect, call open
 	explicit smtp(const config& c);
 
 	~smtp()
 	{
 		disc();
-		WaitForSingleObject(*thread_, INFINITE);
+		if (*thread_ != NULL)
+			WaitForSingleObject(*thread_, INFINITE);
 	}
 
-	void reset_timer(unsigned long max)
-	{
-		max_req_time_ms_ = max;
-		timer_.reset();
-	}
+	// All functions below, except disc, must be called by thread owning
+	// lock of this object (see sync::acquire), which is then held for the
+	// whole verification. Lock is needed because of idle thread.
+
+	// connect and greet remote server. Call only once
+	tcp::status open(const deadline& d);
 
-	void reset_timer()
+	// on any status other than success connection is closed
+	tcp::status send(const std::string& data, const deadline& d)
 	{
-		timer_.reset();
+		try
+		{
+			SetEvent(*event_);
+			const tcp::status result = tcp::socket<smtp>::send(data, d);
+			if (result != tcp::success)
+				return fail(result, "smtp::send");
+			return result;
+		}
+		catch (std::exception&)
+		{
+			close();
+			throw;
+		}
 	}
 
-	void send(const std::string& data)
+	// code is SMTP status of response, valid only on success. Command is
+	// sent in one call from all buffers, which will be modified
+	tcp::status send_recv(WSABUF* buffers, DWORD count, unsigned int& code, const deadline& d)
 	{
 		try
 		{
-			const sync::scoped_lock& g = sync::acquire(socket_lock_);
 			SetEvent(*event_);
-			tcp::socket<smtp>::send(data, timer_, max_req_time_ms_);
+			const tcp::status result = tcp::socket<smtp>::send(buffers, count, d);
+			if (result != tcp::success)
+				return fail(result, "smtp::send_recv");
+			return recv(code, d);
 		}
 		catch (std::exception&)
 		{
-			disc();
+			close();
 			throw;
 		}
 	}
 
-	unsigned int send_recv(const std::string& data)
+	// commands sent together, as allowed by RFC 2920 (see pipelining); codes
+	// are SMTP status of each of count responses, in order of commands
+	tcp::status send_recv(WSABUF* buffers, DWORD count, unsigned int* codes, unsigned int replies, const deadline& d)
 	{
 		try
 		{
-			const sync::scoped_lock& g = sync::acquire(socket_lock_);
 			SetEvent(*event_);
-			tcp::socket<smtp>::send(data, timer_, max_req_time_ms_);
-			return recv();
+			const tcp::status result = tcp::socket<smtp>::send(buffers, count, d);
+			if (result != tcp::success)
+				return fail(result, "smtp::send_recv");
+			return recv(codes, replies, d);
 		}
 		catch (std::exception&)
 		{
-			disc();
+			close();
 			throw;
 		}
 	}
 
+	tcp::status send_recv(const std::string& data, unsigned int& code, const deadline& d)
+	{
+		// I promise that this data won't be modified
+		WSABUF buffer = {static_cast<unsigned long> (data.size()), const_cast<char *> (data.data())};
+		return send_recv(&buffer, 1, code, d);
+	}
+
+	// true if server supports command pipelining. Checked only if
+	// configuration allows pipelining, see config::pipeline_depth
+	bool pipelining() const
+	{
+		return pipelining_;
+	}
+
 	void disc()
 	{
 		const sync::scoped_lock& g = sync::acquire(socket_lock_);
-		const sync::scoped_lock& d = sync::acquire(disconnecting_);
-		connected_ = false;
-
-		SetEvent(*event_);
-		tcp::socket<smtp>::disc("QUIT\r\n");
+		close();
 	}
 
-	bool is_alive(const config& c)
+	bool is_alive(const config& c, const deadline& d)
 	{
-		return tcp::socket<smtp>::is_alive(tcp::ip4_host(c.server_address, c.server_port));
+		return tcp::socket<smtp>::is_alive(tcp::ip4_host(c.server_address, c.server_port), d);
 	}
 };
 
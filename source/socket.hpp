@@ -8,38 +8,158 @@
 
 #include "util.hpp"
 #include "timer.hpp"
+#include "stats.hpp"
 
 namespace tcp
 {
 
 enum {ip4_none = INADDR_NONE};
 
-// This is to isolate other classes from inet_addr winsock function ...
-inline unsigned long ip4_addr(const char* sz)
+namespace detail
 {
-	unsigned int q1 = 0;
-	unsigned int q2 = 0;
-	unsigned int q3 = 0;
-	unsigned int q4 = 0;
-	if (sscanf(sz, "%u.%u.%u.%u", &q1, &q2, &q3, &q4) != 4 ||
-		(q1 & 0xFFFFFF00) || (q2 & 0xFFFFFF00) || (q3 & 0xFFFFFF00) || (q4 & 0xFFFFFF00))
-		return tcp::ip4_none;
 
-	return (q4 << 24) + (q3 << 16) + (q2 << 8) + q1;
+template <typename Char>
+inline int hex(Char ch)
+{
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	else if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	else if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+	return -1;
+}
+
+// parse dotted-quad, i.e. four decimal numbers 0 - 255 of up to 3 digits
+// each. Returns pointer past the address, or NULL if there is none
+template <typename Char>
+inline const Char* ip4_parse(const Char* p, unsigned long& dest)
+{
+	unsigned long ip = 0;
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+		if (i != 0 && *p++ != '.')
+			return NULL;
+
+		unsigned int q = 0;
+		unsigned int digits = 0;
+		for (; digits < 3 && *p >= '0' && *p <= '9'; ++p, ++digits)
+			q = q * 10 + (*p - '0');
+		if (digits == 0 || q > 255 || (*p >= '0' && *p <= '9'))
+			return NULL;
+
+		ip |= static_cast<unsigned long> (q) << (8 * i);
+	}
+
+	dest = ip;
+	return p;
 }
 
-// ... and to provide some extra functionality
-inline unsigned long ip4_addr(const wchar_t* wsz)
+} // namespace detail
+
+// This is to isolate other classes from inet_addr winsock function, and to
+// provide some extra functionality. Parser is strict: no signs, blanks or
+// trailing text are accepted. IPv4 mapped IPv6 address (::ffff:a.b.c.d) is
+// accepted as IPv4 address
+template <typename Char>
+inline bool ip6_addr(const Char* p, unsigned char (&dest)[16]);
+
+template <typename Char>
+inline unsigned long ip4_addr(const Char* sz)
 {
-	unsigned int q1 = 0;
-	unsigned int q2 = 0;
-	unsigned int q3 = 0;
-	unsigned int q4 = 0;
-	if (swscanf(wsz, L"%u.%u.%u.%u", &q1, &q2, &q3, &q4) != 4 ||
-		(q1 & 0xFFFFFF00) || (q2 & 0xFFFFFF00) || (q3 & 0xFFFFFF00) || (q4 & 0xFFFFFF00))
+	unsigned long result = 0;
+	const Char* end = detail::ip4_parse(sz, result);
+	if (end != NULL && *end == 0)
+		return result;
+
+	unsigned char ip6[16];
+	if (*sz != ':' || !ip6_addr(sz, ip6))
+		return tcp::ip4_none;
+
+	static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+	if (memcmp(ip6, mapped, sizeof(mapped)) != 0)
 		return tcp::ip4_none;
 
-	return (q4 << 24) + (q3 << 16) + (q2 << 8) + q1;
+	return (static_cast<unsigned long> (ip6[15]) << 24) + (static_cast<unsigned long> (ip6[14]) << 16)
+		+ (static_cast<unsigned long> (ip6[13]) << 8) + ip6[12];
+}
+
+// Text form of IPv6 address, as in RFC 4291 section 2.2, without zone
+// index. Address is stored in dest in network byte order
+template <typename Char>
+inline bool ip6_addr(const Char* p, unsigned char (&dest)[16])
+{
+	unsigned int words[8];
+	unsigned int n = 0;
+	int gap = -1; // position of "::"
+
+	if (*p == ':')
+	{
+		if (*++p != ':')
+			return false;
+		++p;
+		gap = 0;
+	}
+
+	while (*p != 0)
+	{
+		if (n == 8)
+			return false;
+
+		// IPv4 address in last 32 bits
+		unsigned long ip4 = 0;
+		const Char* end = detail::ip4_parse(p, ip4);
+		if (end != NULL && *end == 0)
+		{
+			if (n > 6)
+				return false;
+			words[n++] = ((ip4 & 0xFF) << 8) | ((ip4 >> 8) & 0xFF);
+			words[n++] = (((ip4 >> 16) & 0xFF) << 8) | ((ip4 >> 24) & 0xFF);
+			break;
+		}
+
+		unsigned int w = 0;
+		unsigned int digits = 0;
+		for (; digits < 4 && detail::hex(*p) >= 0; ++p, ++digits)
+			w = (w << 4) | detail::hex(*p);
+		if (digits == 0 || detail::hex(*p) >= 0)
+			return false;
+		words[n++] = w;
+
+		if (*p == 0)
+			break;
+		else if (*p++ != ':')
+			return false;
+
+		if (*p == ':')
+		{
+			if (gap >= 0)
+				return false;
+			gap = static_cast<int> (n);
+			++p;
+		}
+		else if (*p == 0)
+			return false;
+	}
+
+	// "::" stands for at least one group of zeros
+	if (gap < 0 ? n != 8 : n > 7)
+		return false;
+
+	memset(dest, 0, sizeof(dest));
+	unsigned int i = 0;
+	for (; i < n && static_cast<int> (i) != gap; ++i)
+	{
+		dest[2 * i] = static_cast<unsigned char> (words[i] >> 8);
+		dest[2 * i + 1] = static_cast<unsigned char> (words[i]);
+	}
+	for (unsigned int j = 8 - (n - i); i < n; ++i, ++j)
+	{
+		dest[2 * j] = static_cast<unsigned char> (words[i] >> 8);
+		dest[2 * j + 1] = static_cast<unsigned char> (words[i]);
+	}
+
+	return true;
 }
 
 class error : public std::runtime_error
@@ -68,6 +188,61 @@ public:
 	}
 };
 
+// Winsock is initialized by IIS, but not in other processes (e.g. script
+// calling sink directly). Sockets must be closed before this is destroyed
+class startup
+{
+	// non-copyable and non-assignable
+	startup(const startup&);
+	startup& operator=(const startup&);
+
+public:
+	startup()
+	{
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw error("Unable to initialize Winsock");
+	}
+
+	~startup()
+	{
+		WSACleanup();
+	}
+};
+
+// Outcome of IO operation. Timeouts, broken connections and errors
+// reported by Winsock are expected to happen (e.g. when remote server is
+// overloaded) and are not exceptional
+enum status
+{
+	success,
+	pending,	// more data expected, returned by Protocol::on_recv
+	timeout,
+	broken,		// connection closed by remote host
+	failure,	// Winsock error, see socket::last_error
+	invalid		// protocol error
+};
+
+inline const char* describe(status s)
+{
+	switch (s)
+	{
+	case success:
+		return "success";
+	case pending:
+		return "pending";
+	case timeout:
+		return "timeout expired";
+	case broken:
+		return "connection broken";
+	case failure:
+		return "Winsock error";
+	case invalid:
+		return "protocol error";
+	}
+	return "unknown";
+}
+
 class ip4_host
 {
 	unsigned long ip_;
@@ -111,6 +286,17 @@ public:
 	}
 };
 
+// CancelIoEx, which is available since Windows Vista; NULL on older systems.
+// Racing initialization of static is harmless, all threads store the same value
+typedef BOOL (WINAPI *cancel_io_ex_t)(HANDLE, LPOVERLAPPED);
+
+inline cancel_io_ex_t cancel_io_ex()
+{
+	static const cancel_io_ex_t result = reinterpret_cast<cancel_io_ex_t> (
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "CancelIoEx"));
+	return result;
+}
+
 template <unsigned int Size>
 class event_array
 {
@@ -174,6 +360,9 @@ public:
 	}
 };
 
+// Connection owns its wait object and overlapped structure for its whole
+// lifetime, so that IO does not create and close kernel objects. There is
+// at most one overlapped operation pending at any time
 template <typename Protocol>
 class socket
 {
@@ -185,27 +374,174 @@ class socket
 	util::array<char>			buffer_;
 	ip4_host					server_;
 	bool						connected_;
+	int							error_;
+	event_array<1>				events_;
+	WSAOVERLAPPED				overlapped_;
+	bool						pending_;
+
+	// number of Winsock calls, in stats report
+	static stats::probe			syscalls_;
+
+	static void syscall()
+	{
+		stats::count(syscalls_);
+	}
+
+	status fail()
+	{
+		error_ = WSAGetLastError();
+		return failure;
+	}
+
+	WSAOVERLAPPED* overlapped()
+	{
+		memset(&overlapped_, 0, sizeof(overlapped_));
+		overlapped_.hEvent = events_[0];
+		return &overlapped_;
+	}
+
+	// wait for completion of operation started by WSASend or WSARecv, which returned issued
+	status complete(int issued, DWORD& bytes, const deadline& d)
+	{
+		syscall();
+		if (issued == 0)
+		{
+			// completed immediately and bytes is set already, but event is signaled anyway
+			syscall();
+			if (!WSAResetEvent(events_[0]))
+				return fail();
+			return success;
+		}
+		else if (WSAGetLastError() != WSA_IO_PENDING)
+			return fail();
+
+		pending_ = true;
+		syscall();
+		const DWORD wait = WSAWaitForMultipleEvents(events_.size, events_, FALSE, d.ms(), FALSE);
+		if (wait == WSA_WAIT_FAILED)
+			return fail();
+		else if (wait == WSA_WAIT_TIMEOUT)
+			return timeout; // operation remains pending, until abort
+
+		pending_ = false;
+		syscall();
+		if (!WSAResetEvent(events_[0]))
+			return fail();
+
+		DWORD flags = 0;
+		syscall();
+		if (!WSAGetOverlappedResult(socket_, &overlapped_, &bytes, FALSE, &flags))
+			return fail();
+
+		return success;
+	}
+
+	// cancel pending operation, if there is one. Safe for call inside
+	// destructor, also in other thread than one which started operation.
+	// CancelIo would not do that; if CancelIoEx is not available, socket is
+	// closed to cancel operation, and socket_ is left INVALID_SOCKET
+	void abort()
+	{
+		if (!pending_)
+			return;
+
+		const cancel_io_ex_t cancel = cancel_io_ex();
+		if (cancel == NULL || (!cancel(reinterpret_cast<HANDLE> (socket_), &overlapped_) && GetLastError() != ERROR_NOT_FOUND))
+		{
+			closesocket(socket_);
+			socket_ = INVALID_SOCKET;
+		}
+
+		// overlapped_ is owned by the system until operation is completed
+		WSAWaitForMultipleEvents(events_.size, events_, FALSE, WSA_INFINITE, FALSE);
+		WSAResetEvent(events_[0]);
+		pending_ = false;
+	}
 
-	enum {overlapped_sleep_ = 60};
+	status connect(const deadline& d)
+	{
+		sockaddr_in saddr = {AF_INET, htons(server_.port())};
+		saddr.sin_addr.s_addr = server_.ip();
+
+		// socket becomes non-blocking, thus connect will not wait
+		syscall();
+		if (WSAEventSelect(socket_, events_[0], FD_CONNECT) == SOCKET_ERROR)
+			return fail();
+
+		syscall();
+		if (::connect(socket_, reinterpret_cast<SOCKADDR*> (&saddr), sizeof(saddr)) == SOCKET_ERROR
+			&& WSAGetLastError() != WSAEWOULDBLOCK)
+			return fail();
+
+		syscall();
+		const DWORD wait = WSAWaitForMultipleEvents(events_.size, events_, FALSE, d.ms(), FALSE);
+		if (wait == WSA_WAIT_FAILED)
+			return fail();
+		else if (wait == WSA_WAIT_TIMEOUT)
+			return timeout;
+
+		// also resets event
+		WSANETWORKEVENTS events;
+		syscall();
+		if (WSAEnumNetworkEvents(socket_, events_[0], &events) == SOCKET_ERROR)
+			return fail();
+		else if ((events.lNetworkEvents & FD_CONNECT) && events.iErrorCode[FD_CONNECT_BIT] != 0)
+		{
+			error_ = events.iErrorCode[FD_CONNECT_BIT];
+			return failure;
+		}
+
+		// back to blocking mode, overlapped IO will be used from now on
+		unsigned long blocking = 0;
+		syscall();
+		if (WSAEventSelect(socket_, NULL, 0) == SOCKET_ERROR || ioctlsocket(socket_, FIONBIO, &blocking) == SOCKET_ERROR)
+			return fail();
+
+		return success;
+	}
+
+	// single read, bytes is 0 if connection has been closed
+	status read(DWORD& bytes, const deadline& d)
+	{
+		WSABUF buffer = {static_cast<unsigned int> (buffer_.size), buffer_};
+		DWORD flags = 0;
+		bytes = 0;
+		return complete(WSARecv(socket_, &buffer, 1, &bytes, &flags, overlapped(), NULL), bytes, d);
+	}
 
 protected:
+	// does not connect, call open
 	explicit socket(const ip4_host& s) :
+		socket_(INVALID_SOCKET),
 		buffer_(Protocol::buffer_size_),
 		server_(s),
-		connected_ (false)
+		connected_ (false),
+		error_(0),
+		pending_(false)
+	{}
+
+	// connect without blocking past deadline
+	status open(const deadline& d)
 	{
+		if (connected_)
+			return success;
+
+		syscall();
 		socket_ = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
 		if (socket_ == INVALID_SOCKET)
-			error::last("WSASocket");
-
-		sockaddr_in saddr = {AF_INET, htons(s.port())};
-		saddr.sin_addr.s_addr = s.ip();
-
-		if (connect(socket_, reinterpret_cast<SOCKADDR*> (&saddr), sizeof(saddr)) == SOCKET_ERROR)
-			error::last("connect");
+			return fail();
 
+		const status result = connect(d);
+		if (result != success)
+		{
+			closesocket(socket_);
+			socket_ = INVALID_SOCKET;
+			WSAResetEvent(events_[0]);
+			return result;
+		}
 
 		connected_ = true;
+		return success;
 	}
 
 	virtual ~socket()
@@ -219,185 +555,107 @@ protected:
 		if (!connected_)
 			return;
 
-		event_array<1> events(std::nothrow);
-		WSAOVERLAPPED overlapped;
+		// e.g. timed out read
+		abort();
 
-		if (Protocol::send_bye_command_ && !data.empty() && events[0] != WSA_INVALID_EVENT)
+		if (Protocol::send_bye_command_ && !data.empty() && socket_ != INVALID_SOCKET)
 		{
-			timer t;
-			// I promise that this data won't be modified ! It's just
-			// than Winsock don't let me pass const buffer
-			char* datac = const_cast<char *> (data.c_str());
-
-			unsigned int sent = 0;
-			do
-			{
-				WSABUF buffer = {static_cast<unsigned int> (data.size()) - sent, &datac[sent]};
-				overlapped.Internal = overlapped.InternalHigh = overlapped.Offset = overlapped.OffsetHigh = 0;
-				overlapped.hEvent = events[0];
-
-				DWORD bytes = 0;
-				if (WSASend(socket_, &buffer, 1, &bytes, 0, &overlapped, NULL) == SOCKET_ERROR
-					&& WSAGetLastError() != WSA_IO_PENDING)
-					break;
-
-				if (WSAWaitForMultipleEvents(events.size, events, FALSE, static_cast<unsigned long> (t.ms(Protocol::close_timeout_)), FALSE) == WSA_WAIT_FAILED)
-					break;
-
-				if (!WSAResetEvent(events[0]))
-					break;
-
-				DWORD flags = 0;
-				if (!WSAGetOverlappedResult(socket_, &overlapped, &bytes, TRUE, &flags))
-					break;
-
-				if (!bytes)
-					break;
-
-				sent += bytes;
-
-				Sleep(overlapped_sleep_);
-			} while (sent < data.length() && t.ms(Protocol::close_timeout_) > 0LL);
+			const deadline d(Protocol::close_timeout_);
+			send(data, d);
+			abort();
 		}
 
-		// cancel pending IO operation, if there is any
-		CancelIo(reinterpret_cast<HANDLE> (socket_));
-		WSAResetEvent(events[0]);
-
-		if (Protocol::close_gracefully_ && events[0] != WSA_INVALID_EVENT)
+		if (Protocol::close_gracefully_ && socket_ != INVALID_SOCKET)
 		{
-			timer t;
-			// gracefull disconnect
+			// gracefull disconnect, wait for remote host to close connection
+			const deadline d(Protocol::close_timeout_);
 			shutdown(socket_, SD_SEND);
 			DWORD bytes = 0;
-			do
-			{
-				WSABUF buffer = {static_cast<unsigned int> (buffer_.size), buffer_};
-				overlapped.Internal = overlapped.InternalHigh = overlapped.Offset = overlapped.OffsetHigh = 0;
-				overlapped.hEvent = events[0];
-
-				DWORD flags = 0;
-
-				if (WSARecv(socket_, &buffer, 1, &bytes, &flags, &overlapped, NULL) == SOCKET_ERROR
-					&& WSAGetLastError() != WSA_IO_PENDING)
-					break;
-
-				if (WSAWaitForMultipleEvents(events.size, events, FALSE, static_cast<unsigned long> (t.ms(Protocol::close_timeout_)), FALSE) == WSA_WAIT_FAILED)
-					break;
-
-				if (!WSAResetEvent(events[0]))
-					break;
-
-				if (!WSAGetOverlappedResult(socket_, &overlapped, &bytes, FALSE, &flags))
-					break;
-
-				Sleep(overlapped_sleep_);
-			} while (bytes && t.ms(Protocol::close_timeout_) > 0LL);
+			while (read(bytes, d) == success && bytes != 0)
+				;
+			abort();
 		}
 
-		closesocket(socket_);
+		if (socket_ != INVALID_SOCKET)
+			closesocket(socket_);
+		socket_ = INVALID_SOCKET;
 		connected_ = false;
 	}
 
-	void recv(const timer& t, unsigned long m)
+	// receive until Protocol::on_recv returns other status than pending
+	status recv(const deadline& d)
 	{
-		event_array<1> events;
-		WSAOVERLAPPED overlapped;
-
-		DWORD bytes = 0;
 		do
 		{
-			if (t.ms(m) == 0)
-				throw error("Timeout expired in socket::recv");
-
-			WSABUF buffer = {static_cast<unsigned int> (buffer_.size), buffer_};
-			overlapped.Internal = overlapped.InternalHigh = overlapped.Offset = overlapped.OffsetHigh = 0;
-			overlapped.hEvent = events[0];
-
-			DWORD flags = 0;
-
-			if (WSARecv(socket_, &buffer, 1, &bytes, &flags, &overlapped, NULL) == SOCKET_ERROR
-				&& WSAGetLastError() != WSA_IO_PENDING)
-				error::last("WSARecv in socket::recv");
-
-			if (WSAWaitForMultipleEvents(events.size, events, FALSE, static_cast<unsigned long> (t.ms(m)), FALSE) == WSA_WAIT_FAILED)
-				error::last("WSAWaitForMultipleEvents in socket::recv");
-
-			if (!WSAResetEvent(events[0]))
-				error::last("WSAResetEvent in socket::recv");
-
-			while (!WSAGetOverlappedResult(socket_, &overlapped, &bytes, FALSE, &flags))
-			{
-				error::last("WSAGetOverlappedResult in socket::recv");
-
-				if (t.ms(m) == 0)
-					throw error("Timeout expired in socket::recv");
-
-				Sleep(overlapped_sleep_);
-			}
-
-			if (!(static_cast<Protocol*>(this))->on_recv(buffer_, bytes))
-				break;
+			if (d.expired())
+				return timeout;
 
-			Sleep(overlapped_sleep_);
+			DWORD bytes = 0;
+			const status result = read(bytes, d);
+			if (result != success)
+				return result;
+			else if (!bytes)
+				return broken;
+
+			const status parsed = (static_cast<Protocol*>(this))->on_recv(buffer_, bytes);
+			if (parsed != pending)
+				return parsed;
 		} while (true);
 	}
 
-	void send(const std::string& data, const timer& t, unsigned long m)
+	// vectored send, buffers are modified to skip data already sent
+	status send(WSABUF* buffers, DWORD count, const deadline& d)
 	{
-		// I promise that this data won't be modified ! It's just
-		// than Winsock don't let me pass const buffer
-		char* datac = const_cast<char *> (data.c_str());
-		event_array<1> events;
-		WSAOVERLAPPED overlapped;
-
-		unsigned int sent = 0;
+		DWORD bytes = 0;
 		do
 		{
-			if (t.ms(m) == 0)
-				throw error("Timeout expired in socket::send");
-
-			WSABUF buffer = {static_cast<unsigned int> (data.size()) - sent, &datac[sent]};
-			overlapped.Internal = overlapped.InternalHigh = overlapped.Offset = overlapped.OffsetHigh = 0;
-			overlapped.hEvent = events[0];
-
-			DWORD bytes = 0;
-			if (WSASend(socket_, &buffer, 1, &bytes, 0, &overlapped, NULL) == SOCKET_ERROR
-				&& WSAGetLastError() != WSA_IO_PENDING)
-				error::last("WSARecv in socket::send");
-
-			if (WSAWaitForMultipleEvents(events.size, events, FALSE, static_cast<unsigned long> (t.ms(m)), FALSE) == WSA_WAIT_FAILED)
-				error::last("WSAWaitForMultipleEvents in socket::send");
-
-			if (!WSAResetEvent(events[0]))
-				error::last("WSAResetEvent in socket::send");
-
-			DWORD flags = 0;
-
-			if (!WSAGetOverlappedResult(socket_, &overlapped, &bytes, TRUE, &flags))
-				error::last("WSAGetOverlappedResult in socket::send");
-
-			if (!bytes)
-				throw error("Connection broken in socket::send");
-
-			sent += bytes;
-			if (sent >= data.length())
-				break;
-
-			Sleep(overlapped_sleep_);
+			// skip data sent and empty buffers
+			for (; count != 0 && bytes >= buffers->len; ++buffers, --count)
+				bytes -= buffers->len;
+			if (count == 0)
+				return success;
+			buffers->buf += bytes;
+			buffers->len -= bytes;
+
+			if (d.expired())
+				return timeout;
+
+			bytes = 0;
+			const status result = complete(WSASend(socket_, buffers, count, &bytes, 0, overlapped(), NULL), bytes, d);
+			if (result != success)
+				return result;
+			else if (!bytes)
+				return broken;
 		} while (true);
 	}
 
+	status send(const std::string& data, const deadline& d)
+	{
+		// I promise that this data won't be modified ! It's just
+		// than Winsock don't let me pass const buffer
+		WSABUF buffer = {static_cast<unsigned long> (data.size()), const_cast<char *> (data.data())};
+		return send(&buffer, 1, d);
+	}
+
 public:
-	bool is_alive(const ip4_host& s)
+	// Winsock error code of last operation which returned failure
+	int last_error() const
+	{
+		return error_;
+	}
+
+	bool is_alive(const ip4_host& s, const deadline& d)
 	{
 		if (!connected_)
 			return false;
 		else if (server_ != s)
 			return false;
 
-		return (static_cast<Protocol*>(this))->on_is_alive(s);
+		return (static_cast<Protocol*>(this))->on_is_alive(s, d);
 	}
 };
 
+template <typename Protocol>
+stats::probe socket<Protocol>::syscalls_("syscalls");
+
 } // namespace tcp
@@ -0,0 +1,106 @@
+// socketmap.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "socketmap.hpp"
+#include "address.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+stats::probe p_socketmap("socketmap_request");
+
+const char* const notfound = "9:NOTFOUND ,";
+
+void netstring(std::string& out, const char* first, const char* last)
+{
+	char len[16] = {0};
+	str::format(len, "%u:", static_cast<unsigned int> (last - first));
+	out += len;
+	out.append(first, last);
+	out += ',';
+}
+
+} // unnamed namespace
+
+size_t socketmap::on_recv(const char* data, size_t len, std::string& reply)
+{
+	// keys of all complete requests, pointing into data
+	std::vector<std::pair<const char*, const char*> > keys;
+	const char* const end = data + len;
+	const char* p = data;
+	while (p != end)
+	{
+		size_t size = 0;
+		const char* q = p;
+		for (; q != end && *q >= '0' && *q <= '9'; ++q)
+		{
+			if (static_cast<size_t> (q - p) == max_digits)
+				return listener::npos;
+			size = size * 10 + (*q - '0');
+		}
+
+		if (q == end)
+			break;
+		else if (q == p || *q != ':' || size > max_request)
+			return listener::npos;
+
+		// need whole netstring, with trailing comma
+		if (static_cast<size_t> (end - q) < size + 2)
+			break;
+		const char* const first = q + 1;
+		const char* const last = first + size;
+		if (*last != ',')
+			return listener::npos;
+
+		const char* key = static_cast<const char*> (memchr(first, ' ', size));
+		key = (key == NULL ? last : key + 1);
+		keys.push_back(std::make_pair(key, last));
+		p = last + 1;
+	}
+
+	if (keys.empty())
+		return p - data;
+
+	// key is arbitrary data sent by client. Anything but valid address (e.g.
+	// no key, control characters or angle brackets) is not verified, and
+	// answered NOTFOUND
+	const stats::scope s_socketmap(p_socketmap);
+	std::vector<service::recipient> rcpts;
+	std::vector<bool> valid(keys.size());
+	rcpts.reserve(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		const char* begin = NULL;
+		const char* finish = NULL;
+		if (address::parse(keys[i].first, keys[i].second - keys[i].first, begin, finish) != address::valid || *begin == '<')
+			continue;
+
+		valid[i] = true;
+		rcpts.push_back(service::recipient());
+		rcpts.back().rcpt.assign(begin, finish);
+	}
+	if (!rcpts.empty())
+		service_.verify(&rcpts[0], rcpts.size());
+
+	std::string ok;
+	for (size_t i = 0, j = 0; i < keys.size(); ++i)
+	{
+		if (!valid[i] || rcpts[j++].result == service::rejected)
+		{
+			reply += notfound;
+			continue;
+		}
+
+		ok.assign("OK ");
+		ok.append(keys[i].first, keys[i].second);
+		netstring(reply, ok.data(), ok.data() + ok.size());
+	}
+
+	return p - data;
+}
@@ -0,0 +1,34 @@
+// socketmap.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "listener.hpp"
+#include "service.hpp"
+
+// Sendmail socketmap protocol, also used by Postfix and Exim. Request is
+// netstring "len:map key," where key is recipient address; name of map is
+// ignored. Reply is "OK key" if recipient is accepted or cannot be
+// verified, and "NOTFOUND " if it is rejected or key is not valid address
+// (see address::parse). Netstrings are parsed in
+// place, and all requests received together are verified together, with
+// replies sent in the same order.
+class socketmap : public listener::protocol
+{
+	// non-copyable and non-assignable
+	socketmap(const socketmap&);
+	socketmap& operator=(const socketmap&);
+
+	static const size_t max_request = 8192;
+	static const size_t max_digits = 5;		// enough for max_request
+
+	service&						service_;
+
+public:
+	explicit socketmap(service& s) : service_(s) {}
+
+	size_t on_recv(const char* data, size_t len, std::string& reply);
+};
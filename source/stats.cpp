@@ -0,0 +1,141 @@
+// stats.cpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#include "stdafx.h"
+
+#include "stats.hpp"
+#include "util.hpp"
+#include "util_win32.hpp"
+
+namespace
+{
+
+// list of all probes. Zero-initialized before any constructor is run
+stats::probe*			head;
+volatile LONG			head_lock;
+volatile LONG			last_report;
+
+void write(const char* file, const std::string& text)
+{
+	if (*file == '\0')
+	{
+		OutputDebugStringA(text.c_str());
+		return;
+	}
+
+	const HANDLE h = CreateFileA(file, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+	win32::handle f(h);
+
+	DWORD written = 0;
+	WriteFile(*f, text.data(), static_cast<DWORD> (text.size()), &written, NULL);
+}
+
+} // unnamed namespace
+
+namespace stats
+{
+
+volatile LONG enabled = 0;
+
+probe::probe(const char* name) :
+	name_(name),
+	next_(NULL)
+{
+	for (unsigned int i = 0; i < stripes; ++i)
+	{
+		stripes_[i].lock = 0;
+		stripes_[i].count = 0;
+		stripes_[i].ticks = 0;
+	}
+
+	while (InterlockedExchange(&head_lock, 1) != 0)
+		Sleep(0);
+	next_ = head;
+	head = this;
+	InterlockedExchange(&head_lock, 0);
+}
+
+contention::contention(const char* name)
+{
+	static const char* const suffix[2 + buckets] = {"", ":contended", ":<10us", ":<100us", ":<1ms", ":<10ms", ":>=10ms"};
+	for (unsigned int i = 0; i < 2 + buckets; ++i)
+		names_[i] = std::string("lock:") + name + suffix[i];
+
+	all_.reset(new probe(names_[0].c_str()));
+	contended_.reset(new probe(names_[1].c_str()));
+	for (unsigned int i = 0; i < buckets; ++i)
+		histogram_[i].reset(new probe(names_[2 + i].c_str()));
+}
+
+void contention::acquired(__int64 wait)
+{
+	if (!enabled)
+		return;
+
+	all_->add(wait);
+	if (wait == 0)
+		return;
+
+	contended_->add(wait);
+
+	const __int64 us = (1000000LL * wait) / counter_frequency<0>::value;
+	unsigned int i = 0;
+	for (__int64 limit = 10; i < buckets - 1 && us >= limit; limit *= 10)
+		++i;
+	histogram_[i]->add(0);
+}
+
+void report(unsigned int interval, const char* file)
+{
+	InterlockedExchange(&enabled, interval != 0 ? 1 : 0);
+	if (interval == 0)
+		return;
+
+	// only one thread will write report
+	const LONG last = last_report;
+	const DWORD now = GetTickCount();
+	if (now - static_cast<DWORD> (last) < interval * 1000UL)
+		return;
+	if (InterlockedCompareExchange(&last_report, static_cast<LONG> (now), last) != last)
+		return;
+
+	const __int64 frequency = counter_frequency<0>::value;
+	const unsigned long t = static_cast<unsigned long> (time(NULL));
+
+	std::string text, line;
+	for (probe* p = head; p != NULL; p = p->next_)
+	{
+		unsigned __int64 count = 0;
+		unsigned __int64 ticks = 0;
+		for (unsigned int i = 0; i < probe::stripes; ++i)
+		{
+			probe::stripe& s = p->stripes_[i];
+			while (InterlockedExchange(&s.lock, 1) != 0)
+				Sleep(0);
+			count += s.count;
+			ticks += s.ticks;
+			s.count = 0;
+			s.ticks = 0;
+			InterlockedExchange(&s.lock, 0);
+		}
+
+		if (count == 0)
+			continue;
+
+		const unsigned __int64 ns = static_cast<unsigned __int64> (
+			static_cast<double> (ticks) * 1e9 / static_cast<double> (frequency) / static_cast<double> (count));
+		str::format(line, "%lu,%s,%I64u,%I64u\n", t, p->name_, count, ns);
+		text += line;
+	}
+
+	if (!text.empty())
+		write(file, text);
+}
+
+} // namespace stats
@@ -0,0 +1,137 @@
+// stats.hpp
+
+// Copyright (C) Bronislaw Kozicki 2004. Use, modification and
+// distribution is subject to the Common Public License Version 1.0
+// See license.txt or http://www.opensource.org/licenses/cpl.php
+
+#pragma once
+
+#include "timer.hpp"
+#include "util_synch.hpp"
+
+// Profiling of functions called for each RCPT command. Each probe counts
+// calls and time spent in them; all probes are written periodically as
+// CSV lines "time,name,calls,ns per call", so that numbers from
+// different builds can be compared. When reports are disabled probes do
+// not read the clock.
+namespace stats
+{
+
+class probe
+{
+	// non-copyable and non-assignable
+	probe(const probe&);
+	probe& operator=(const probe&);
+
+	// threads add to stripe selected by thread id, thus they rarely meet on
+	// the same lock; report sums all stripes
+	enum {stripes = 16};
+
+	struct stripe
+	{
+		volatile LONG			lock;
+		unsigned __int64		count;
+		unsigned __int64		ticks;
+		char					padding[40];	// stripe per cache line
+	};
+
+	const char* const			name_;
+	probe*						next_;
+	stripe						stripes_[stripes];
+
+	friend void report(unsigned int, const char*);
+
+public:
+	// must be static object, i.e. live as long as the module
+	explicit probe(const char* name);
+
+	void add(__int64 ticks)
+	{
+		// no waiting here; stripe taken by other thread is skipped
+		for (unsigned int i = (GetCurrentThreadId() >> 2) % stripes; ; i = (i + 1) % stripes)
+		{
+			stripe& s = stripes_[i];
+			if (InterlockedExchange(&s.lock, 1) != 0)
+				continue;
+
+			++s.count;
+			s.ticks += ticks;
+			InterlockedExchange(&s.lock, 0);
+			return;
+		}
+	}
+};
+
+// non-zero if reports are enabled
+extern volatile LONG enabled;
+
+// time spent in the scope
+class scope
+{
+	// non-copyable and non-assignable
+	scope(const scope&);
+	scope& operator=(const scope&);
+
+	probe&						probe_;
+	__int64						start_;
+
+public:
+	explicit scope(probe& p) : probe_(p), start_(enabled ? timer::now() : 0)
+	{}
+
+	~scope()
+	{
+		stop();
+	}
+
+	// end of measured time, if it is before end of the scope
+	void stop()
+	{
+		if (start_ != 0)
+			probe_.add(timer::now() - start_);
+		start_ = 0;
+	}
+
+	// nothing to measure after all, time is not added to probe
+	void cancel()
+	{
+		start_ = 0;
+	}
+};
+
+// count event without measuring time
+inline void count(probe& p)
+{
+	if (enabled)
+		p.add(0);
+}
+
+// Contention of lock (see win32::critical_section), reported as probes
+// "lock:name" (all acquisitions, with average wait), "lock:name:contended"
+// (acquisitions which had to wait, with average wait) and histogram of
+// these waits, "lock:name:<10us" to "lock:name:>=10ms"
+class contention : public sync::monitor
+{
+	// non-copyable and non-assignable
+	contention(const contention&);
+	contention& operator=(const contention&);
+
+	enum {buckets = 5};
+
+	std::string					names_[2 + buckets];
+	std::auto_ptr<probe>		all_;
+	std::auto_ptr<probe>		contended_;
+	std::auto_ptr<probe>		histogram_[buckets];
+
+public:
+	// must be static object, i.e. live as long as the module
+	explicit contention(const char* name);
+
+	void acquired(__int64 wait);
+};
+
+// write and reset all probes, if interval (in seconds) has elapsed since
+// last report. Interval 0 disables reports. Empty file name means debug output
+void report(unsigned int interval, const char* file);
+
+} // namespace stats
@@ -34,12 +34,16 @@
 
 // C++ standard library headers
 #include <cctype>
+#include <ctime>
 #include <cwctype>
 #include <string>
 #include <vector>
 #include <set>
+#include <deque>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <functional>
 
 
 using namespace ATL;
@@ -103,4 +103,38 @@ public:
 	}
 };
 
+// Frequency of performance counter, read once when module is loaded
+template <int>
+struct counter_frequency
+{
+	static const __int64 value;
+};
+
+template <int N>
+const __int64 counter_frequency<N>::value = timer::freq();
+
+// Point in time by which operation must be completed. Created once and
+// passed to all steps of the operation, so that total time is bounded
+class deadline
+{
+	__int64 end_;
+
+public:
+	explicit deadline(unsigned long ms) :
+		end_(timer::now() + (counter_frequency<0>::value * ms) / 1000)
+	{}
 
+	bool expired() const
+	{
+		return timer::now() >= end_;
+	}
+
+	unsigned long ms() const
+	{
+		// remaining milliseconds, rounded up
+		const __int64 left = end_ - timer::now();
+		if (left <= 0)
+			return 0;
+		return static_cast<unsigned long> ((1000LL * left + counter_frequency<0>::value - 1) / counter_frequency<0>::value);
+	}
+};
@@ -466,6 +466,23 @@ inline void lower(std::basic_string<Char>& str)
 	std::for_each(str.begin(), str.end(), chars<Char>::tolower);
 }
 
+// 64-bit FNV-1a hash, see http://www.isthe.com/chongo/tech/comp/fnv/
+inline unsigned __int64 hash(const char* data, size_t len, unsigned __int64 seed = 0)
+{
+	unsigned __int64 result = 14695981039346656037ULL ^ seed;
+	for (size_t i = 0; i < len; ++i)
+	{
+		result ^= static_cast<unsigned char> (data[i]);
+		result *= 1099511628211ULL;
+	}
+	return result;
+}
+
+inline unsigned __int64 hash(const std::string& str, unsigned __int64 seed = 0)
+{
+	return hash(str.data(), str.size(), seed);
+}
+
 } // namespace str
 
 namespace com
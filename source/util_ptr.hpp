@@ -66,8 +66,68 @@ inline lock<Synch> try_acquire(ptr<Type, Synch>& synch, unsigned long timeout)
 template <typename Type, typename Synch>
 inline lock<Synch> try_acquire(ptr<Type, Synch>& synch)
 {
-	return lock<Synch>(synch.syn_, lock<Synch>::dont_wait());
+	return lock<Synch>(synch.syn_, typename lock<Synch>::dont_wait());
 }
 
 
+// reference counted pointer. Counter is updated with interlocked functions,
+// thus copies of the same pointer might be used and destroyed by different
+// threads. The pointer object itself is not synchronized, just like any other
+template <typename Type>
+class shared
+{
+	struct holder
+	{
+		Type*			ptr;
+		volatile LONG	refs;
+	};
+
+	holder* h_;
+
+	void release()
+	{
+		if (h_ != NULL && InterlockedDecrement(&h_->refs) == 0)
+		{
+			delete h_->ptr;
+			delete h_;
+		}
+	}
+
+public:
+	shared() : h_(NULL) {}
+
+	explicit shared(Type * p) : h_(NULL)
+	{
+		std::auto_ptr<Type> t(p);
+		h_ = new holder;
+		h_->ptr = t.release();
+		h_->refs = 1;
+	}
+
+	shared(const shared& rh) : h_(rh.h_)
+	{
+		if (h_ != NULL)
+			InterlockedIncrement(&h_->refs);
+	}
+
+	~shared()
+	{
+		release();
+	}
+
+	shared& operator=(const shared& rh)
+	{
+		shared t(rh);
+		std::swap(h_, t.h_);
+		return *this;
+	}
+
+	Type& operator*() const {return *h_->ptr;}
+	Type* operator->() const {return h_->ptr;}
+	Type* get() const {return h_ != NULL ? h_->ptr : NULL;}
+	void reset() {shared().swap(*this);}
+	void swap(shared& rh) {std::swap(h_, rh.h_);}
+};
+
+
 } // namespace sync
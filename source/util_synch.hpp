@@ -16,6 +16,10 @@ struct error : public std::runtime_error
 };
 
 
+// Lock of any type, to be used as:
+//   const sync::scoped_lock& g = sync::acquire(x);
+// Returned temporary lock<Synch> is destroyed by its own destructor, thus
+// nothing here is virtual; release is called through function pointer
 class scoped_lock
 {
   // non-assignable and non-copyable
@@ -23,72 +27,85 @@ class scoped_lock
   scoped_lock(const scoped_lock& rh);
 
 protected:
-  scoped_lock() {}
-
-public:
-  virtual ~scoped_lock() {}
-  virtual void unlock() const = 0;
-  virtual bool active() const = 0;
-};
+  typedef void (*release_t)(void*);
 
+  mutable void* synch_;
+  const release_t release_;
 
-template <typename Synch>
-class lock : public scoped_lock
-{
-  // non-assignable
-  lock& operator=(const lock&);
+  scoped_lock(void* synch, release_t release) : synch_(synch), release_(release) {}
 
-  mutable Synch* synch_;
+  ~scoped_lock()
+  {
+    unlock();
+  }
 
-  Synch* release() const
+  void* take() const
   {
-    Synch* t = synch_;
+    void* t = synch_;
     synch_ = NULL;
 
     return t;
   }
 
 public:
-  struct dont_wait{};
-
-  explicit lock(Synch& synch) : synch_(&synch)
+  void unlock() const
   {
-    synch_->acquire();
+    if (synch_ != NULL)
+      release_(take());
   }
 
-  lock(Synch& synch, unsigned long timeout) : synch_(&synch)
+  bool active() const
   {
-    if (!synch_->try_acquire(timeout))
-      release();
+    return synch_ != NULL;
   }
+};
+
+
+// Receives notifications about acquisitions of lock, e.g. to measure contention
+class monitor
+{
+protected:
+  ~monitor() {}
+
+public:
+  // wait is in performance counter ticks, 0 if lock was not contended
+  virtual void acquired(__int64 wait) = 0;
+};
+
+
+template <typename Synch>
+class lock : public scoped_lock
+{
+  // non-assignable
+  lock& operator=(const lock&);
 
-  lock(Synch& synch, const dont_wait&) : synch_(&synch)
+  static void release(void* synch)
   {
-    if (!synch_->try_acquire())
-      release();
+    static_cast<Synch*> (synch)->release();
   }
 
-  lock(const lock& rh) : scoped_lock(), synch_(rh.release())
+public:
+  struct dont_wait{};
+
+  explicit lock(Synch& synch) : scoped_lock(&synch, &lock::release)
   {
+    synch.acquire();
   }
 
-  ~lock()
+  lock(Synch& synch, unsigned long timeout) : scoped_lock(&synch, &lock::release)
   {
-    unlock();
+    if (!synch.try_acquire(timeout))
+      take();
   }
 
-  void unlock() const
+  lock(Synch& synch, const dont_wait&) : scoped_lock(&synch, &lock::release)
   {
-    if (synch_ != NULL)
-    {
-      synch_->release();
-      release();
-    }
+    if (!synch.try_acquire())
+      take();
   }
 
-  bool active() const
+  lock(const lock& rh) : scoped_lock(rh.take(), &lock::release)
   {
-    return synch_ != NULL;
   }
 };
 
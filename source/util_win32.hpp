@@ -20,15 +20,31 @@ private:
   critical_section& operator=(const critical_section&);
 
   CRITICAL_SECTION primitive_;
+  sync::monitor* monitor_;
 
 public:
-  critical_section()
+  critical_section() : monitor_(NULL)
   {
     // TODO : handle potential SEH, documented at
     // http://msdn.microsoft.com/library/en-us/dllproc/base/initializecriticalsection.asp
     InitializeCriticalSection(&primitive_);
   }
 
+  explicit critical_section(unsigned long spin) : monitor_(NULL)
+  {
+    // spin before waiting on kernel object; only useful on SMP machines
+    // http://msdn.microsoft.com/library/en-us/dllproc/base/initializecriticalsectionandspincount.asp
+    if (!InitializeCriticalSectionAndSpinCount(&primitive_, spin))
+      throw sync::error("InitializeCriticalSectionAndSpinCount failed");
+  }
+
+  // every acquisition will be reported to m, which must outlive this object
+  critical_section(sync::monitor& m, unsigned long spin) : monitor_(&m)
+  {
+    if (!InitializeCriticalSectionAndSpinCount(&primitive_, spin))
+      throw sync::error("InitializeCriticalSectionAndSpinCount failed");
+  }
+
   ~critical_section()
   {
     DeleteCriticalSection(&primitive_);
@@ -39,7 +55,23 @@ private:
   {
     // TODO : handle potential SEH, documented at
     // http://msdn.microsoft.com/library/en-us/dllproc/base/entercriticalsection.asp
-    EnterCriticalSection(&primitive_);
+    if (monitor_ == NULL)
+    {
+      EnterCriticalSection(&primitive_);
+      return;
+    }
+
+    if (TryEnterCriticalSection(&primitive_))
+    {
+      monitor_->acquired(0);
+      return;
+    }
+
+    LARGE_INTEGER start, stop;
+    QueryPerformanceCounter(&start);
+    EnterCriticalSection(&primitive_); // spins first, if spin count is set
+    QueryPerformanceCounter(&stop);
+    monitor_->acquired(std::max(stop.QuadPart - start.QuadPart, static_cast<LONGLONG> (1)));
   }
 
 #if(_WIN32_WINNT >= 0x0400)